@@ -0,0 +1,37 @@
+# Generate a synthetic DTB corpus with dtbgen and time dtbtool on it.
+# Run through the 'benchmark' target, which passes all variables below.
+
+execute_process(
+    COMMAND ${CMAKE_COMMAND} -E remove_directory ${CORPUS}
+)
+execute_process(
+    COMMAND ${CMAKE_COMMAND} -E make_directory ${CORPUS}
+)
+
+message(STATUS "Generating ${FILES} DTBs in ${CORPUS}")
+execute_process(
+    COMMAND ${DTBGEN} -n ${FILES} -m ${MSM_IDS} -b ${BOARD_IDS} -p ${PMIC_IDS}
+                      -s ${DTB_SIZE} -d ${DEPTH} -w ${FANOUT} -D ${DUPLICATES}
+                      ${CORPUS}
+    RESULT_VARIABLE rc
+    OUTPUT_QUIET
+)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "dtbgen failed: ${rc}")
+endif()
+
+message(STATUS "Running dtbtool --jobs ${JOBS}")
+execute_process(
+    COMMAND ${DTBTOOL} --timing --jobs ${JOBS} -o ${OUTPUT} ${CORPUS}/
+    RESULT_VARIABLE rc
+    OUTPUT_VARIABLE log
+)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "dtbtool failed: ${rc}")
+endif()
+
+# only the summary, not the per DTB log
+string(REGEX MATCHALL "=> [^\n]*" summary "${log}")
+foreach(line ${summary})
+    message("${line}")
+endforeach()
@@ -0,0 +1,44 @@
+# Check that a warm --cache run writes the same dt.img as a cold one.
+# Run through ctest, which passes DTBGEN, DTBTOOL, WORKDIR and the
+# dtbgen id counts below.
+
+set(CORPUS ${WORKDIR}/corpus)
+set(CACHE_FILE ${WORKDIR}/dtb.cache)
+
+execute_process(
+    COMMAND ${CMAKE_COMMAND} -E remove_directory ${WORKDIR}
+)
+execute_process(
+    COMMAND ${CMAKE_COMMAND} -E make_directory ${CORPUS}
+)
+
+execute_process(
+    COMMAND ${DTBGEN} -n 64 -m 2 -b ${BOARD_IDS} -p ${PMIC_IDS} -s 4096
+                      -D 25 ${CORPUS}
+    RESULT_VARIABLE rc
+    OUTPUT_QUIET
+)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "dtbgen failed: ${rc}")
+endif()
+
+foreach(run cold warm)
+    execute_process(
+        COMMAND ${DTBTOOL} -m 1 --cache ${CACHE_FILE} -o ${WORKDIR}/${run}.img
+                           ${CORPUS}/
+        RESULT_VARIABLE rc
+        OUTPUT_QUIET
+    )
+    if(NOT rc EQUAL 0)
+        message(FATAL_ERROR "dtbtool (${run}) failed: ${rc}")
+    endif()
+endforeach()
+
+execute_process(
+    COMMAND ${CMAKE_COMMAND} -E compare_files ${WORKDIR}/cold.img
+                                              ${WORKDIR}/warm.img
+    RESULT_VARIABLE rc
+)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "warm and cold dt.img differ")
+endif()
@@ -0,0 +1,56 @@
+/* Copyright (c) 2012-2014, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * * Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Rewrite of a DTB for EFIDroid, done in memory: one DTB per chip entry
+ * libboot finds in it, with 'qcom,msm-id', 'qcom,board-id' and
+ * 'qcom,pmic-id' reduced to that entry and the entry itself stored in
+ * 'efidroid-soc-info'.  Used by dtbefidroidify and dtbtool --efidroid.
+ */
+#ifndef __EFIDROIDIFY_H
+#define __EFIDROIDIFY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <lib/boot.h>
+#include <lib/boot/qcdt.h>
+
+// called with every rewritten DTB, which is only valid during the call
+typedef int (*efidroidify_cb_t)(void *ctx, const void *fdt, uint32_t size,
+                                const dt_entry_local_t *entry);
+
+/*
+ * Rewrite fdt for every chip entry libboot's parser finds in it and pass
+ * the results to callback.  The entries are printed to log unless it's
+ * NULL, errors go to err.  Returns 0 or a negative error.
+ */
+int efidroidify_dtb(const void *fdt, size_t size, int remove_unused_nodes, const char *parser,
+                    FILE *log, FILE *err, efidroidify_cb_t callback, void *ctx);
+
+#endif
@@ -0,0 +1,24 @@
+/*
+ * Finds the FDTs in a blob like a kernel image with appended DTBs.  A
+ * compressed stream at the start (gzip, and lz4 with HAVE_LZ4) is
+ * decompressed on the fly.  Used by fdtextract and dtbtool.
+ */
+#ifndef __FDTSCAN_H
+#define __FDTSCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// called with every FDT found, which is only valid during the call
+typedef int (*fdt_found_t)(void *ctx, const void *fdt, uint32_t size);
+
+/*
+ * Pass every FDT in data to found, in order, until it returns non-zero.
+ * Compressed data at the start, like Image.gz-dtb or a compressed blob of
+ * DTBs, is decompressed on the fly and scanned as it comes.  The rest, e.g.
+ * the DTBs appended to the compressed kernel, is scanned in place.  Returns
+ * 0, what found returned or a negative error.
+ */
+int fdt_extract(const unsigned char *data, size_t size, fdt_found_t found, void *ctx);
+
+#endif
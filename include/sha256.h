@@ -0,0 +1,157 @@
+/*
+ * SHA-256 as specified in FIPS 180-4
+ */
+#ifndef __SHA256_H
+#define __SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE  64
+
+struct sha256_ctx {
+	uint32_t state[8];
+	uint64_t count;
+	uint8_t buf[SHA256_BLOCK_SIZE];
+};
+typedef struct sha256_ctx sha256_ctx_t;
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline void sha256_init(sha256_ctx_t *ctx)
+{
+	ctx->state[0] = 0x6a09e667;
+	ctx->state[1] = 0xbb67ae85;
+	ctx->state[2] = 0x3c6ef372;
+	ctx->state[3] = 0xa54ff53a;
+	ctx->state[4] = 0x510e527f;
+	ctx->state[5] = 0x9b05688c;
+	ctx->state[6] = 0x1f83d9ab;
+	ctx->state[7] = 0x5be0cd19;
+	ctx->count = 0;
+}
+
+static inline void sha256_transform(sha256_ctx_t *ctx, const uint8_t *data)
+{
+	static const uint32_t k[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+	};
+
+	uint32_t w[64], s[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[i * 4 + 1] << 16) |
+		       ((uint32_t)data[i * 4 + 2] << 8) | (uint32_t)data[i * 4 + 3];
+	}
+	for (i = 16; i < 64; i++) {
+		w[i] = w[i - 16] + w[i - 7] +
+		       (SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+		       (SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+	}
+
+	memcpy(s, ctx->state, sizeof(s));
+	for (i = 0; i < 64; i++) {
+		t1 = s[7] + (SHA256_ROR(s[4], 6) ^ SHA256_ROR(s[4], 11) ^ SHA256_ROR(s[4], 25)) +
+		     ((s[4] & s[5]) ^ (~s[4] & s[6])) + k[i] + w[i];
+		t2 = (SHA256_ROR(s[0], 2) ^ SHA256_ROR(s[0], 13) ^ SHA256_ROR(s[0], 22)) +
+		     ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		s[7] = s[6];
+		s[6] = s[5];
+		s[5] = s[4];
+		s[4] = s[3] + t1;
+		s[3] = s[2];
+		s[2] = s[1];
+		s[1] = s[0];
+		s[0] = t1 + t2;
+	}
+	for (i = 0; i < 8; i++)
+		ctx->state[i] += s[i];
+}
+
+static inline void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	size_t fill = ctx->count % SHA256_BLOCK_SIZE;
+	size_t n;
+
+	ctx->count += len;
+
+	if (fill) {
+		n = SHA256_BLOCK_SIZE - fill;
+		if (n > len)
+			n = len;
+		memcpy(ctx->buf + fill, p, n);
+		p += n;
+		len -= n;
+		if (fill + n < SHA256_BLOCK_SIZE)
+			return;
+		sha256_transform(ctx, ctx->buf);
+	}
+
+	while (len >= SHA256_BLOCK_SIZE) {
+		sha256_transform(ctx, p);
+		p += SHA256_BLOCK_SIZE;
+		len -= SHA256_BLOCK_SIZE;
+	}
+
+	memcpy(ctx->buf, p, len);
+}
+
+static inline void sha256_final(sha256_ctx_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+	uint64_t bits = ctx->count * 8;
+	size_t fill = ctx->count % SHA256_BLOCK_SIZE;
+	int i;
+
+	ctx->buf[fill++] = 0x80;
+	if (fill > SHA256_BLOCK_SIZE - 8) {
+		memset(ctx->buf + fill, 0, SHA256_BLOCK_SIZE - fill);
+		sha256_transform(ctx, ctx->buf);
+		fill = 0;
+	}
+	memset(ctx->buf + fill, 0, SHA256_BLOCK_SIZE - 8 - fill);
+	for (i = 0; i < 8; i++)
+		ctx->buf[SHA256_BLOCK_SIZE - 1 - i] = (uint8_t)(bits >> (i * 8));
+	sha256_transform(ctx, ctx->buf);
+
+	for (i = 0; i < 8; i++) {
+		digest[i * 4]     = (uint8_t)(ctx->state[i] >> 24);
+		digest[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+		digest[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+		digest[i * 4 + 3] = (uint8_t)(ctx->state[i]);
+	}
+}
+
+static inline void sha256(const void *data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+	sha256_ctx_t ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, len);
+	sha256_final(&ctx, digest);
+}
+
+/* lowercase hex representation, str needs 2 * SHA256_DIGEST_SIZE + 1 bytes */
+static inline void sha256_to_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+		str[i * 2]     = hex[digest[i] >> 4];
+		str[i * 2 + 1] = hex[digest[i] & 0xf];
+	}
+	str[i * 2] = '\0';
+}
+
+#endif
@@ -0,0 +1,266 @@
+/*
+ * Synthetic DTB corpus generator for benchmarking dtbtool.
+ *
+ * Every generated DTB has a root node with the properties dtbtool looks
+ * at: 'model', 'qcom,msm-id' and, depending on the options, 'qcom,board-id'
+ * and 'qcom,pmic-id'.  A padding property brings it to about the requested
+ * size.
+ * The output only depends on the options, so corpora are reproducible.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <getopt.h>
+#include <libfdt.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define MAX_FILES 50000
+
+#define PADDING_PROP "dtbgen,padding"
+
+static int num_files = 1000;
+static int num_msm_ids = 1;
+static int num_board_ids = 1;
+static int num_pmic_ids = 0;
+static int dtb_size = 0;
+static int depth = 0;
+static int fanout = 8;
+static int dup_percent = 0;
+static uint32_t seed = 1;
+
+static void print_help(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options] outdir\n", name);
+    fprintf(stderr, "  -n <count>   number of DTBs (1-%d, default %d)\n", MAX_FILES, num_files);
+    fprintf(stderr, "  -m <count>   'qcom,msm-id' tuples per DTB (default %d)\n", num_msm_ids);
+    fprintf(stderr, "  -b <count>   'qcom,board-id' tuples per DTB, 0 for v1 DTBs (default %d)\n", num_board_ids);
+    fprintf(stderr, "  -p <count>   'qcom,pmic-id' tuples per DTB, 0 for v2 DTBs (default %d)\n", num_pmic_ids);
+    fprintf(stderr, "  -s <bytes>   approximate DTB size (default: as small as possible)\n");
+    fprintf(stderr, "  -d <levels>  directory nesting (default %d)\n", depth);
+    fprintf(stderr, "  -w <count>   subdirectories per directory (default %d)\n", fanout);
+    fprintf(stderr, "  -D <percent> DTBs which are copies of an earlier one (default %d)\n", dup_percent);
+    fprintf(stderr, "  -r <seed>    random seed (default %u)\n", seed);
+}
+
+// xorshift32, never returns 0 for a non-zero state
+static uint32_t next_random(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static int put_cells(void *fdt, const char *name, uint32_t *state,
+                     int tuples, int ncells, uint32_t first)
+{
+    fdt32_t cells[4 * 64];
+    int i, j;
+
+    if (tuples * ncells > (int)(sizeof(cells) / sizeof(cells[0])))
+        return -FDT_ERR_NOSPACE;
+
+    for (i = 0; i < tuples; i++) {
+        // the first cell makes the tuple unique to its DTB
+        cells[i * ncells] = cpu_to_fdt32(first + i);
+        for (j = 1; j < ncells; j++)
+            cells[i * ncells + j] = cpu_to_fdt32(next_random(state) % 16);
+    }
+
+    return fdt_property(fdt, name, cells, tuples * ncells * sizeof(fdt32_t));
+}
+
+// build the DTB with the given content id into buf, returns its size
+static int build_dtb(void *buf, int bufsize, uint32_t id, int padding)
+{
+    uint32_t state = (seed ^ (id * 2654435761u)) | 1;
+    char model[32];
+    void *zeroes = NULL;
+    int rc;
+
+    rc = fdt_create(buf, bufsize);
+    if (!rc) rc = fdt_finish_reservemap(buf);
+    if (!rc) rc = fdt_begin_node(buf, "");
+
+    snprintf(model, sizeof(model), "Synthetic board %u", id);
+    if (!rc) rc = fdt_property_string(buf, "model", model);
+
+    if (num_board_ids == 0) {
+        // v1: <chipset platform rev>
+        if (!rc) rc = put_cells(buf, "qcom,msm-id", &state, num_msm_ids, 3,
+                                id * num_msm_ids + 1);
+    } else {
+        // v2/v3: <chipset rev>, <platform subtype>, <pmic0 pmic1 pmic2 pmic3>
+        if (!rc) rc = put_cells(buf, "qcom,msm-id", &state, num_msm_ids, 2,
+                                id * num_msm_ids + 1);
+        if (!rc) rc = put_cells(buf, "qcom,board-id", &state, num_board_ids, 2,
+                                id * num_board_ids + 1);
+        if (!rc && num_pmic_ids)
+            rc = put_cells(buf, "qcom,pmic-id", &state, num_pmic_ids, 4,
+                           id * num_pmic_ids + 1);
+    }
+
+    if (!rc && padding > 0) {
+        zeroes = calloc(1, padding);
+        if (!zeroes)
+            return -FDT_ERR_NOSPACE;
+        rc = fdt_property(buf, PADDING_PROP, zeroes, padding);
+        free(zeroes);
+    }
+
+    if (!rc) rc = fdt_end_node(buf);
+    if (!rc) rc = fdt_finish(buf);
+
+    return rc ? rc : (int)fdt_totalsize(buf);
+}
+
+// directory of the i-th DTB, created if needed
+static int make_dir(char *path, size_t size, const char *outdir, int i)
+{
+    int level, rc;
+    size_t len;
+
+    rc = snprintf(path, size, "%s", outdir);
+    if (rc < 0 || (size_t)rc >= size)
+        return -ENAMETOOLONG;
+
+    for (level = 0; level < depth; level++) {
+        len = strlen(path);
+        rc = snprintf(path + len, size - len, "/d%d", i % fanout);
+        if (rc < 0 || (size_t)rc >= size - len)
+            return -ENAMETOOLONG;
+        i /= fanout;
+
+        if (mkdir(path, 0755) && errno != EEXIST) {
+            fprintf(stderr, "Can't create directory %s\n", path);
+            return -errno;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char dirname[PATH_MAX];
+    char filename[PATH_MAX];
+    void *buf = NULL;
+    int bufsize, size;
+    int c, i, fd, rc = 0;
+    uint32_t id, state;
+    ssize_t ssize;
+    const char *outdir;
+
+    while ((c = getopt(argc, argv, "n:m:b:p:s:d:w:D:r:h")) != -1) {
+        switch (c) {
+        case 'n': num_files = atoi(optarg); break;
+        case 'm': num_msm_ids = atoi(optarg); break;
+        case 'b': num_board_ids = atoi(optarg); break;
+        case 'p': num_pmic_ids = atoi(optarg); break;
+        case 's': dtb_size = atoi(optarg); break;
+        case 'd': depth = atoi(optarg); break;
+        case 'w': fanout = atoi(optarg); break;
+        case 'D': dup_percent = atoi(optarg); break;
+        case 'r': seed = strtoul(optarg, NULL, 0); break;
+        default:
+            print_help(argv[0]);
+            return -EINVAL;
+        }
+    }
+
+    // validate arguments
+    if (optind + 1 != argc || num_files < 1 || num_files > MAX_FILES ||
+        num_msm_ids < 1 || num_msm_ids > 64 ||
+        num_board_ids < 0 || num_board_ids > 64 ||
+        num_pmic_ids < 0 || num_pmic_ids > 64 ||
+        (num_board_ids == 0 && num_pmic_ids) ||
+        dtb_size < 0 || dtb_size > 64 * 1024 * 1024 ||
+        depth < 0 || fanout < 1 || dup_percent < 0 || dup_percent > 100) {
+        print_help(argv[0]);
+        return -EINVAL;
+    }
+    outdir = argv[optind];
+    if (!seed)
+        seed = 1;
+
+    if (mkdir(outdir, 0755) && errno != EEXIST) {
+        fprintf(stderr, "Can't create directory %s\n", outdir);
+        return -errno;
+    }
+
+    // allocate buffer
+    bufsize = dtb_size + 4096 + 3 * 64 * 4 * sizeof(fdt32_t);
+    buf = malloc(bufsize);
+    if (!buf) {
+        fprintf(stderr, "Can't allocate buffer of size %d\n", bufsize);
+        return -ENOMEM;
+    }
+
+    state = seed;
+    for (i = 0; i < num_files; i++) {
+        // duplicates reuse the content of an earlier DTB
+        id = i;
+        if (i > 0 && (int)(next_random(&state) % 100) < dup_percent)
+            id = next_random(&state) % i;
+
+        size = build_dtb(buf, bufsize, id, 0);
+
+        // grow it with a padding property: tag, length, name offset,
+        // value and the name in the strings block
+        if (size >= 0 && size + 12 + (int)sizeof(PADDING_PROP) < dtb_size)
+            size = build_dtb(buf, bufsize, id,
+                             dtb_size - size - 12 - sizeof(PADDING_PROP));
+        if (size < 0) {
+            fprintf(stderr, "Can't build DTB %d: %s\n", i, fdt_strerror(size));
+            rc = -EINVAL;
+            break;
+        }
+
+        rc = make_dir(dirname, sizeof(dirname), outdir, i);
+        if (rc)
+            break;
+
+        // build filename
+        rc = snprintf(filename, sizeof(filename), "%s/%05d.dtb", dirname, i);
+        if (rc < 0 || (size_t)rc >= sizeof(filename)) {
+            fprintf(stderr, "Can't build filename\n");
+            rc = -ENAMETOOLONG;
+            break;
+        }
+        rc = 0;
+
+        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "Can't open file %s\n", filename);
+            rc = -errno;
+            break;
+        }
+
+        ssize = write(fd, buf, size);
+        if (close(fd) || ssize != size) {
+            fprintf(stderr, "Can't write file %s\n", filename);
+            rc = -EIO;
+            break;
+        }
+    }
+
+    free(buf);
+
+    if (rc) {
+        fprintf(stderr, "ERROR: %s\n", strerror(-rc));
+        return rc;
+    }
+
+    printf("generated %d DTBs in %s\n", num_files, outdir);
+    return 0;
+}
@@ -35,11 +35,21 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <errno.h>
+#include <endian.h>
 #include <unistd.h>
 #include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <libfdt.h>
+
+#include <efidroidify.h>
+#include <fdtscan.h>
+#include <sha256.h>
 
 #define QCDT_MAGIC     "QCDT"  /* Master DTB magic */
 #define QCDT_VERSION   3       /* QCDT version */
@@ -50,19 +60,33 @@
 #define QCDT_MODEL_TAG "model = \""
 #define QCDT_QCOM_MODEL_TAG "qcom,model = \""
 
+#define QCDT_BOARD_PROP "qcom,board-id"
+#define QCDT_PMIC_PROP  "qcom,pmic-id"
+#define QCDT_MODEL_PROP "model"
+
 
 #define PAGE_SIZE_DEF  2048
 #define PAGE_SIZE_MAX  (1024*1024)
 
-#define log_err(x...)  printf(x)
-#define log_info(x...) printf(x)
-#define log_dbg(x...)  { if (verbose) printf(x); }
+#define log_out        (output_file && !strcmp(output_file, "-") ? stderr : stdout)
+#define log_err(x...)  fprintf(log_file ? log_file : log_out, x)
+#define log_info(x...) fprintf(log_file ? log_file : log_out, x)
+#define log_dbg(x...)  { if (verbose) fprintf(log_file ? log_file : log_out, x); }
 
 #define COPY_BLK       1024    /* File copy block size */
+#define COPY_BUF_SIZE  (1024*1024) /* read/write fallback buffer size */
 
 #define RC_SUCCESS     0
 #define RC_ERROR       -1
 
+#define INPUT_DIR      0       /* directory tree of .dtb files */
+#define INPUT_FDT      1       /* concatenated DTBs */
+#define INPUT_TAR      2       /* tar archive */
+#define INPUT_LIST     3       /* NUL separated list of DTB paths */
+#define INPUT_KERNEL   4       /* DTBs found in a kernel image */
+
+#define STREAM_DTB_MAX (64*1024*1024) /* sanity limit for streamed DTBs */
+
 struct chipInfo_t {
   uint32_t chipset;
   uint32_t platform;
@@ -72,16 +96,30 @@ struct chipInfo_t {
   char     model[32];
   uint32_t dtb_size;
   char     *dtb_file;
+  int      dtb_spooled;         /* payload is in the spool file */
+  off_t    dtb_spool_offset;
+  size_t   dtb_spool_size;
+  void     *dtb_data;           /* spooled payload held in memory */
   struct chipInfo_t *prev;
   struct chipInfo_t *next;
   struct chipInfo_t *master;
   int      wroteDtb;
   uint32_t master_offset;
   struct chipInfo_t *t_next;
+  size_t   seq;
+  size_t   group;
+  int      in_table;
 };
 
 struct chipInfo_t *chip_list;
 
+static struct chipInfo_t **chip_array;
+static size_t chip_array_count, chip_array_alloc;
+static uint8_t *chip_claimed;
+
+/* Log of the current thread, NULL for log_out */
+static __thread FILE *log_file;
+
 struct chipId_t {
   uint32_t chipset;
   uint32_t revNum;
@@ -105,28 +143,147 @@ struct chipPt_t {
   struct chipPt_t *t_next;
 };
 
+/* Everything dtbtool needs to know about one DTB */
+struct dtbInfo_t {
+  uint32_t version;             /* QCDT version required by the DTB */
+  int      num;                 /* number of 'qcom,msm-id' entries */
+  char     model[32];           /* root 'model', empty if missing */
+  uint8_t  hash[SHA256_DIGEST_SIZE]; /* of the whole file, with --cache */
+  struct chipInfo_t *chip;      /* entries, chained by t_next */
+};
+
+/*
+  Cache of classification results, see cache_load().  The file is written
+  in host byte order:
+    header   struct dtbCacheHdr_t, followed by dt_tag and dtc_path
+    record   struct dtbCacheRec_t, followed by the path (with its
+             terminating NUL), the classification log and the entries
+ */
+#define CACHE_MAGIC    "DTBC"
+#define CACHE_VERSION  2
+
+struct dtbCacheHdr_t {
+  char     magic[4];
+  uint32_t version;
+  uint32_t motorola_version;    /* options the results depend on */
+  uint32_t use_dtc;
+  uint32_t dt_tag_len;
+  uint32_t dtc_path_len;
+  uint32_t count;               /* number of records */
+};
+
+struct dtbCacheRec_t {
+  uint64_t size;                /* of the DTB file */
+  int64_t  mtime_sec;
+  int64_t  mtime_nsec;
+  uint8_t  hash[SHA256_DIGEST_SIZE];
+  char     model[32];
+  uint32_t version;
+  int32_t  num;
+  uint32_t path_len;
+  uint32_t log_len;
+  uint32_t count;               /* number of entries */
+  uint32_t reserved;
+};
+
+struct dtbCacheEntry_t {
+  uint32_t chipset;
+  uint32_t platform;
+  uint32_t subtype;
+  uint32_t revNum;
+  uint32_t pmic_model[4];
+};
+
+struct dtbCache_t {
+  struct dtbCacheRec_t rec;
+  const char *path;
+  const char *log;
+  const uint8_t *entries;       /* may be unaligned */
+};
+
+static char *cache_buf;
+static struct dtbCache_t *cache_recs;
+static struct dtbCache_t **cache_table;
+static size_t cache_table_size;
+
+/* One DTB queued for classification by the --jobs workers */
+struct dtbJob_t {
+  char     *filename;
+  struct dtbInfo_t info;
+  int      rc;
+  int      done;
+  struct dtbCache_t *cache;     /* results for the new cache */
+  int      cached;              /* results were taken from the cache */
+  int      spooled;             /* streamed DTB, kept in the spool file */
+  off_t    spool_offset;
+  size_t   spool_size;
+  void     *data;               /* or held in memory if set */
+  int      rewritten;           /* --efidroid: replaced by its rewrites */
+  struct dtbJob_t *rewrites;    /* until they are linked in after it */
+  FILE     *log_file;
+  char     *log;
+  size_t   log_size;
+  struct dtbJob_t *next;
+};
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  job_cond = PTHREAD_COND_INITIALIZER;
+static struct dtbJob_t *job_head, *job_tail, *job_next, *job_pending;
+static int job_finished;
+
 char *input_dir;
 char *output_file;
 char *dtc_path;
 char *dt_tag = QCDT_DT_TAG;
+char *dt_prop;
 int   verbose;
 int   page_size = PAGE_SIZE_DEF;
 int   version_override = 0;
 int   motorola_version = 0;
+int   use_dtc = 0;
+int   num_jobs = 1;
+char *cache_file;
+int   input_format = INPUT_DIR;
+int   timing = 0;
+char *efidroid_parser;
+int   remove_unused_nodes = 0;
+
+/* --timing results of the phases */
+static int    time_files;
+static double time_scan, time_add, time_write, time_log;
+static size_t log_bytes;
+
+/* streamed DTBs, see read_stream() */
+static int   spool_fd = -1;
+static off_t spool_end;
 
 void print_help()
 {
     log_info("dtbTool version %d (kinda :) )\n", QCDT_VERSION);
     log_info("dtbTool [options] -o <output file> <input DTB path>\n");
+    log_info("dtbTool [options] -i <format> -o <output file> [<input file>]\n");
     log_info("  options:\n");
     log_info("  --output-file/-o     output file\n");
     log_info("  --dtc-path/-p        path to dtc\n");
     log_info("  --page-size/-s       page size in bytes\n");
     log_info("  --dt-tag/-d          alternate QCDT_DT_TAG\n");
+    log_info("  --timing/-t          print the time taken by each phase\n");
     log_info("  --verbose/-v         verbose\n");
     log_info("  --force-v2/-2        output dtb v2 format\n");
     log_info("  --force-v3/-3        output dtb v3 format\n");
     log_info("  --motorola/m         Motorola dtb version\n");
+    log_info("  --use-dtc/-u         decompile DTBs with dtc instead of libfdt\n");
+    log_info("  --jobs/-j            number of DTBs to parse in parallel (0: #cpus)\n");
+    log_info("  --cache/-c           cache file to reuse results of unchanged DTBs\n");
+    log_info("  --input-format/-i    read DTBs from a file or stdin ('-') instead of a\n"
+             "                       directory: 'fdt' (concatenated DTBs), 'tar',\n"
+             "                       'list' (NUL separated paths) or 'kernel' (DTBs\n"
+             "                       appended to a possibly compressed kernel, like\n"
+             "                       fdtextract finds them); output file '-' is stdout\n");
+    log_info("  --efidroid/-e        rewrite the DTBs for EFIDroid with the given libboot\n"
+             "                       parser in memory, like dtbefidroidify\n");
+    log_info("  --remove-unused-nodes/-r  with --efidroid, remove the nodes EFIDroid\n"
+             "                       doesn't use\n");
     log_info("  --help/-h            this help screen\n");
 }
 
@@ -142,12 +299,19 @@ int parse_commandline(int argc, char *const argv[])
         {"force-v2",    0, 0, '2'},
         {"force-v3",    0, 0, '3'},
         {"motorola",    1, 0, 'm'},
+        {"use-dtc",     0, 0, 'u'},
+        {"jobs",        1, 0, 'j'},
+        {"cache",       1, 0, 'c'},
+        {"input-format", 1, 0, 'i'},
+        {"efidroid",    1, 0, 'e'},
+        {"remove-unused-nodes", 0, 0, 'r'},
+        {"timing",      0, 0, 't'},
         {"verbose",     0, 0, 'v'},
         {"help",        0, 0, 'h'},
         {0, 0, 0, 0}
     };
 
-    while ((c = getopt_long(argc, argv, "-o:p:s:d:23m:vh", long_options, NULL))
+    while ((c = getopt_long(argc, argv, "-o:p:s:d:23m:uj:c:i:e:rtvh", long_options, NULL))
            != -1) {
         switch (c) {
         case 1:
@@ -181,6 +345,46 @@ int parse_commandline(int argc, char *const argv[])
         case 'm':
             motorola_version = atoi(optarg);
             break;
+        case 'u':
+            use_dtc = 1;
+            break;
+        case 'j':
+            num_jobs = atoi(optarg);
+            if (num_jobs == 0)
+                num_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+            if (num_jobs <= 0) {
+                log_err("Invalid number of jobs\n");
+                return RC_ERROR;
+            }
+            break;
+        case 'c':
+            cache_file = optarg;
+            break;
+        case 'i':
+            if (!strcmp(optarg, "dir")) {
+                input_format = INPUT_DIR;
+            } else if (!strcmp(optarg, "fdt")) {
+                input_format = INPUT_FDT;
+            } else if (!strcmp(optarg, "tar")) {
+                input_format = INPUT_TAR;
+            } else if (!strcmp(optarg, "list")) {
+                input_format = INPUT_LIST;
+            } else if (!strcmp(optarg, "kernel")) {
+                input_format = INPUT_KERNEL;
+            } else {
+                log_err("Unknown input format '%s'\n", optarg);
+                return RC_ERROR;
+            }
+            break;
+        case 'e':
+            efidroid_parser = optarg;
+            break;
+        case 'r':
+            remove_unused_nodes = 1;
+            break;
+        case 't':
+            timing = 1;
+            break;
         case 'v':
             verbose = 1;
             break;
@@ -196,393 +400,264 @@ int parse_commandline(int argc, char *const argv[])
     }
 
     if (!input_dir)
-        input_dir = "./";
+        input_dir = input_format == INPUT_DIR ? "./" : "-";
+
+    if (use_dtc && (input_format == INPUT_FDT || input_format == INPUT_TAR ||
+                    input_format == INPUT_KERNEL || efidroid_parser)) {
+        log_err("Streamed DTBs can't be decompiled with dtc\n");
+        return RC_ERROR;
+    }
+
+    /* only DTB files have a path and mtime to find their record by */
+    if (cache_file && (input_format == INPUT_FDT || input_format == INPUT_TAR ||
+                       input_format == INPUT_KERNEL || efidroid_parser)) {
+        log_err("--cache needs DTB files, not streamed or --efidroid DTBs\n");
+        return RC_ERROR;
+    }
+
+    if (remove_unused_nodes && !efidroid_parser) {
+        log_err("--remove-unused-nodes needs --efidroid\n");
+        return RC_ERROR;
+    }
 
     if (!dtc_path)
         dtc_path = "";
 
+    /* property name of the dt tag, i.e. "qcom,msm-id = <" -> "qcom,msm-id" */
+    dt_prop = strndup(dt_tag, strcspn(dt_tag, " ="));
+    if (!dt_prop) {
+        log_err("Out of memory\n");
+        return RC_ERROR;
+    }
+
     return RC_SUCCESS;
 }
 
-/* Unique entry sorted list add (by chipset->platform->rev) */
-int chip_add(struct chipInfo_t *c)
+/*
+  All entries are collected in chip_array first and sorted once by their
+  full key, which puts duplicates next to each other.  chip_add() then only
+  has to claim the group of equal entries, and chip_finish() builds the
+  sorted chip_list (by chipset->platform->subtype->rev, in order of
+  discovery for equal ones) from the claimed entries.
+ */
+static int chip_cmp_key(const struct chipInfo_t *a, const struct chipInfo_t *b)
 {
-    struct chipInfo_t *x = chip_list;
-
-    if (!chip_list) {
-        chip_list = c;
-        c->next = NULL;
-        c->prev = NULL;
-        return RC_SUCCESS;
-    }
+    const uint32_t ka[] = { a->chipset, a->platform, a->subtype, a->revNum };
+    const uint32_t kb[] = { b->chipset, b->platform, b->subtype, b->revNum };
+    int i;
 
-    while (1) {
-        if ((c->chipset < x->chipset) ||
-            ((c->chipset == x->chipset) &&
-             ((c->platform < x->platform) ||
-              ((c->platform == x->platform) &&
-               ((c->subtype < x->subtype) ||
-                ((c->subtype == x->subtype) &&
-                 (c->revNum < x->revNum))))))) {
-            if (!x->prev) {
-                c->next = x;
-                c->prev = NULL;
-                x->prev = c;
-                chip_list = c;
-                break;
-            } else {
-                c->next = x;
-                c->prev = x->prev;
-                x->prev->next = c;
-                x->prev = c;
-                break;
-            }
-        }
-        if ((c->chipset == x->chipset) &&
-            (c->platform == x->platform) &&
-            (c->subtype == x->subtype) &&
-            (c->revNum == x->revNum) &&
-            (c->pmic_model[0] == x->pmic_model[0]) &&
-            (c->pmic_model[1] == x->pmic_model[1]) &&
-            (c->pmic_model[2] == x->pmic_model[2]) &&
-            (c->pmic_model[3] == x->pmic_model[3])) {
-            return RC_ERROR;  /* duplicate */
-        }
-        if (!x->next) {
-            c->prev = x;
-            c->next = NULL;
-            x->next = c;
-            break;
-        }
-        x = x->next;
+    for (i = 0; i < 4; i++) {
+        if (ka[i] != kb[i])
+            return ka[i] < kb[i] ? -1 : 1;
     }
-    return RC_SUCCESS;
+    return 0;
 }
 
-void chip_deleteall()
+static int chip_cmp_pmic(const struct chipInfo_t *a, const struct chipInfo_t *b)
 {
-    struct chipInfo_t *c = chip_list, *t;
+    int i;
 
-    while (c) {
-        t = c;
-        c = c->next;
-        if (t->dtb_file)
-            free(t->dtb_file);
-        free(t);
+    for (i = 0; i < 4; i++) {
+        if (a->pmic_model[i] != b->pmic_model[i])
+            return a->pmic_model[i] < b->pmic_model[i] ? -1 : 1;
     }
+    return 0;
 }
 
-/*
-  For v1 Extract 'qcom,msm-id' parameter triplet from DTB
-      qcom,msm-id = <x y z>;
+static int chip_cmp_seq(const struct chipInfo_t *a, const struct chipInfo_t *b)
+{
+    if (a->seq != b->seq)
+        return a->seq < b->seq ? -1 : 1;
+    return 0;
+}
 
-  For v2 Extract 'qcom,msm-id', 'qcom,board-id' parameter double from DTB
-      qcom,msm-id = <x z> i.e chipset, revision number;
-      qcom,board-id = <y y'> i.e platform and sub-type;
- */
+/* qsort: full key, then order of discovery */
+static int chip_cmp_full(const void *pa, const void *pb)
+{
+    const struct chipInfo_t *a = *(struct chipInfo_t * const *)pa;
+    const struct chipInfo_t *b = *(struct chipInfo_t * const *)pb;
+    int rc;
+
+    rc = chip_cmp_key(a, b);
+    if (!rc)
+        rc = chip_cmp_pmic(a, b);
+    if (!rc)
+        rc = chip_cmp_seq(a, b);
+    return rc;
+}
 
-struct chipInfo_t *getChipInfo(const char *filename, int *num, uint32_t msmversion)
+/* qsort: table order */
+static int chip_cmp_table(const void *pa, const void *pb)
 {
+    const struct chipInfo_t *a = *(struct chipInfo_t * const *)pa;
+    const struct chipInfo_t *b = *(struct chipInfo_t * const *)pb;
+    int rc;
 
-    const char str1[] = "dtc -I dtb -O dts \"";
-    const char str2[] = "\" 2>&1";
-    char *buf, *pos;
-    char *line = NULL;
-    char *model = NULL;
-    size_t line_size;
-    FILE *pfile;
-    int llen;
-    struct chipInfo_t *chip = NULL, *tmp, *chip_t;
-    uint32_t data[3] = {0, 0, 0};
-    uint32_t data_st[2] = {0, 0};
-    uint32_t data_pt[4] = {0, 0, 0, 0};
-    char *tok, *sptr = NULL;
-    int i, entryValid, entryEnded;
-    int count = 0, count1 = 0, count2 = 0, count3 = 0;
-    int entryValidST, entryEndedST, entryValidDT, entryEndedDT, entryValidPT, entryEndedPT;
-    struct chipId_t *chipId = NULL, *cId = NULL, *tmp_id = NULL;
-    struct chipSt_t *chipSt = NULL, *cSt = NULL, *tmp_st = NULL;
-    struct chipPt_t *chipPt = NULL, *cPt = NULL, *tmp_pt = NULL;
-    struct chipId_t *chipId_tmp = NULL;
-    struct chipSt_t *chipSt_tmp = NULL;
-    struct chipPt_t *chipPt_tmp = NULL;
+    rc = chip_cmp_key(a, b);
+    if (!rc)
+        rc = chip_cmp_seq(a, b);
+    return rc;
+}
 
-    line_size = 1024;
-    line = (char *)malloc(line_size);
-    if (!line) {
-        log_err("Out of memory\n");
-        return NULL;
+/* Append the t_next chained entries of one DTB to chip_array */
+static int chip_collect(struct chipInfo_t *chip)
+{
+    struct chipInfo_t **tmp, *c;
+    size_t count = 0, alloc;
+
+    for (c = chip; c; c = c->t_next)
+        count++;
+
+    if (chip_array_count + count > chip_array_alloc) {
+        alloc = chip_array_alloc ? chip_array_alloc : 1024;
+        while (alloc < chip_array_count + count)
+            alloc *= 2;
+        tmp = (struct chipInfo_t **)realloc(chip_array, alloc * sizeof(*tmp));
+        if (!tmp) {
+            log_err("Out of memory\n");
+            return RC_ERROR;
+        }
+        chip_array = tmp;
+        chip_array_alloc = alloc;
     }
 
-    llen = sizeof(char) * (strlen(dtc_path) +
-                           strlen(str1) +
-                           strlen(str2) +
-                           strlen(filename) + 1);
-    buf = (char *)malloc(llen);
-    if (!buf) {
-        log_err("Out of memory\n");
-        free(line);
-        return NULL;
+    for (c = chip; c; c = c->t_next) {
+        c->seq = chip_array_count;
+        c->in_table = 0;
+        chip_array[chip_array_count++] = c;
     }
+    return RC_SUCCESS;
+}
 
-    strncpy(buf, dtc_path, llen);
-    strncat(buf, str1, llen);
-    strncat(buf, filename, llen);
-    strncat(buf, str2, llen);
-
-    pfile = popen(buf, "r");
-    free(buf);
+/* Sort all collected entries once and number the groups of equal ones */
+static int chip_group(void)
+{
+    size_t i, groups = 0;
 
-    if (pfile == NULL) {
-        log_err("... skip, fail to decompile dtb\n");
-    } else {
-        /* Find "qcom,msm-id" */
-        while ((llen = getline(&line, &line_size, pfile)) != -1) {
-            if (msmversion == 1) {
-                if ((pos = strstr(line, dt_tag)) != NULL) {
-                    pos += strlen(dt_tag);
-
-                    entryEnded = 0;
-                    while (1) {
-                        entryValid = 1;
-                        for (i = 0; i < 3; i++) {
-                            tok = strtok_r(pos, " \t", &sptr);
-                            pos = NULL;
-                            if (tok != NULL) {
-                                if (*tok == '>') {
-                                    entryEnded = 1;
-                                    entryValid = 0;
-                                    break;
-                                }
-                                data[i] = strtoul(tok, NULL, 0);
-                            } else {
-                                data[i] = 0;
-                                entryValid = 0;
-                                entryEnded = 1;
-                            }
-                        }
-                        if (entryEnded) {
-                            free(line);
-                            pclose(pfile);
-                            *num = count;
-                            return chip;
-                        }
-                        if (entryValid) {
-                            tmp = (struct chipInfo_t *)
-                                      malloc(sizeof(struct chipInfo_t));
-                            if (!tmp) {
-                                log_err("Out of memory\n");
-                                break;
-                            }
-                            if (!chip) {
-                                chip = tmp;
-                                chip->t_next = NULL;
-                            } else {
-                                tmp->t_next = chip->t_next;
-                                chip->t_next = tmp;
-                            }
-                            tmp->chipset  = data[0];
-                            tmp->platform = data[1];
-                            tmp->subtype  = 0;
-                            tmp->revNum   = data[2];
-                            tmp->pmic_model[0] = 0;
-                            tmp->pmic_model[1] = 0;
-                            tmp->pmic_model[2] = 0;
-                            tmp->pmic_model[3] = 0;
-                            tmp->dtb_size = 0;
-                            tmp->dtb_file = NULL;
-                            tmp->master   = chip;
-                            tmp->wroteDtb = 0;
-                            tmp->master_offset = 0;
-                            count++;
-                        }
-                    }
+    qsort(chip_array, chip_array_count, sizeof(*chip_array), chip_cmp_full);
 
-                    log_err("... skip, incorrect '%s' format\n", dt_tag);
-                    break;
-                }
-            } else if (msmversion == 2 || msmversion == 3) {
-                if ((pos = strstr(line, dt_tag)) != NULL) {
-                    pos += strlen(dt_tag);
-
-                    entryEndedDT = 0;
-                    for (;entryEndedDT < 1;) {
-                        entryValidDT = 1;
-                        for (i = 0; i < 2; i++) {
-                            tok = strtok_r(pos, " \t", &sptr);
-                            pos = NULL;
-                            if (tok != NULL) {
-                                if (*tok == '>') {
-                                    entryEndedDT = 1;
-                                    entryValidDT = 0;
-                                    break;
-                                }
-                                data_st[i] = strtoul(tok, NULL, 0);
-                            } else {
-                                data_st[i] = 0;
-                                entryValidDT = 0;
-                                entryEndedDT = 1;
-                            }
-                        }
+    for (i = 0; i < chip_array_count; i++) {
+        if (i == 0 ||
+            chip_cmp_key(chip_array[i - 1], chip_array[i]) ||
+            chip_cmp_pmic(chip_array[i - 1], chip_array[i]))
+            groups++;
+        chip_array[i]->group = groups - 1;
+    }
 
-                        if (entryValidDT) {
-                            tmp_id = (struct chipId_t *)
-                                         malloc(sizeof(struct chipId_t));
-                            if (!tmp_id) {
-                                log_err("Out of memory\n");
-                                break;
-                            }
-                            if (!chipId) {
-                                chipId = tmp_id;
-                                cId = tmp_id;
-                                chipId->t_next = NULL;
-                            } else {
-                                tmp_id->t_next = chipId->t_next;
-                                chipId->t_next = tmp_id;
-                            }
-                            tmp_id->chipset = data_st[0];
-                            tmp_id->revNum= data_st[1];
-                            count1++;
-                        }
-                    }
-                }
+    chip_claimed = (uint8_t *)calloc(groups ? groups : 1, sizeof(uint8_t));
+    if (!chip_claimed) {
+        log_err("Out of memory\n");
+        return RC_ERROR;
+    }
+    return RC_SUCCESS;
+}
 
-                if ((pos = strstr(line,QCDT_BOARD_TAG)) != NULL) {
-                    pos += strlen(QCDT_BOARD_TAG);
-                    entryEndedST = 0;
-                    for (;entryEndedST < 1;) {
-                        entryValidST = 1;
-                        for (i = 0; i < 2; i++) {
-                            tok = strtok_r(pos, " \t", &sptr);
-                            pos = NULL;
-                            if (tok != NULL) {
-                                if (*tok == '>') {
-                                    entryEndedST = 1;
-                                    entryValidST = 0;
-                                    break;
-                                }
-                                data_st[i] = strtoul(tok, NULL, 0);
-                            } else {
-                                data_st[i] = 0;
-                                entryValidST = 0;
-                                entryEndedST = 1;
-                            }
-                        }
-                        if (entryValidST) {
-                            tmp_st = (struct chipSt_t *)
-                                       malloc(sizeof(struct chipSt_t));
-                            if (!tmp_st) {
-                                log_err("Out of memory\n");
-                                break;
-                            }
+/* Unique entry add, fails if an equal entry was added before */
+int chip_add(struct chipInfo_t *c)
+{
+    if (chip_claimed[c->group])
+        return RC_ERROR;  /* duplicate */
 
-                            if (!chipSt) {
-                                chipSt = tmp_st;
-                                cSt = tmp_st;
-                                chipSt->t_next = NULL;
-                            } else {
-                                tmp_st->t_next = chipSt->t_next;
-                                chipSt->t_next = tmp_st;
-                            }
+    chip_claimed[c->group] = 1;
+    c->in_table = 1;
+    return RC_SUCCESS;
+}
 
-                            tmp_st->platform = data_st[0];
-                            tmp_st->subtype= data_st[1];
-                            count2++;
-                        }
-                    }
-                }
+/* Build the sorted chip_list from the added entries, free all others */
+static void chip_finish(void)
+{
+    size_t i, count = 0;
 
-                if ((pos = strstr(line,QCDT_PMIC_TAG)) != NULL) {
-                    pos += strlen(QCDT_PMIC_TAG);
-                    entryEndedPT = 0;
-                    for (;entryEndedPT < 1;) {
-                        entryValidPT = 1;
-                        for (i = 0; i < 4; i++) {
-                            tok = strtok_r(pos, " \t", &sptr);
-                            pos = NULL;
-                            if (tok != NULL) {
-                                if (*tok == '>') {
-                                    entryEndedPT = 1;
-                                    entryValidPT = 0;
-                                    break;
-                                }
-                                data_pt[i] = strtoul(tok, NULL, 0);
-                            } else {
-                                data_pt[i] = 0;
-                                entryValidPT = 0;
-                                entryEndedPT = 1;
-                            }
-                        }
-                        if (entryValidPT) {
-                            tmp_pt = (struct chipPt_t *)
-                                       malloc(sizeof(struct chipPt_t));
-                            if (!tmp_pt) {
-                                log_err("Out of memory\n");
-                                break;
-                            }
+    for (i = 0; i < chip_array_count; i++) {
+        if (chip_array[i]->in_table) {
+            chip_array[count++] = chip_array[i];
+        } else {
+            if (chip_array[i]->dtb_file)
+                free(chip_array[i]->dtb_file);
+            free(chip_array[i]->dtb_data);
+            free(chip_array[i]);
+        }
+    }
 
-                            if (!chipPt) {
-                                chipPt = tmp_pt;
-                                cPt = tmp_pt;
-                                chipPt->t_next = NULL;
-                            } else {
-                                tmp_pt->t_next = chipPt->t_next;
-                                chipPt->t_next = tmp_pt;
-                            }
+    qsort(chip_array, count, sizeof(*chip_array), chip_cmp_table);
 
-                            tmp_pt->pmic0 = data_pt[0];
-                            tmp_pt->pmic1 = data_pt[1];
-                            tmp_pt->pmic2 = data_pt[2];
-                            tmp_pt->pmic3 = data_pt[3];
-                            count3++;
-                        }
-                    }
-                }
+    chip_list = NULL;
+    for (i = 0; i < count; i++) {
+        chip_array[i]->prev = i ? chip_array[i - 1] : NULL;
+        chip_array[i]->next = (i + 1 < count) ? chip_array[i + 1] : NULL;
+    }
+    if (count)
+        chip_list = chip_array[0];
+
+    free(chip_array);
+    chip_array = NULL;
+    chip_array_count = chip_array_alloc = 0;
+    free(chip_claimed);
+    chip_claimed = NULL;
+}
 
-                if (motorola_version && (pos = strstr(line,QCDT_MODEL_TAG)) != NULL && strstr(line,QCDT_QCOM_MODEL_TAG) == NULL) {
-                    char *model_end;
-                    int model_len;
+void chip_deleteall()
+{
+    struct chipInfo_t *c = chip_list, *t;
 
-                    pos += strlen(QCDT_MODEL_TAG);
+    while (c) {
+        t = c;
+        c = c->next;
+        if (t->dtb_file)
+            free(t->dtb_file);
+        free(t->dtb_data);
+        free(t);
+    }
+}
 
-                    if ((model_end=strchr(pos, '"')) != NULL && (model_len=model_end-pos)<32) {
-                        model = malloc(model_len+1);
-                        if (!model) {
-                            log_err("Out of memory\n");
-                            break;
-                        }
+/* Free a t_next chained list which was never added to chip_list */
+static void chip_free_list(struct chipInfo_t *chip)
+{
+    struct chipInfo_t *t;
 
-                        memset(model, 0, model_len+1);
-                        strncat(model, pos, model_len);
-                        printf("Found model %s\n", model);
-                    }
-                }
-            }
-        }
+    while (chip) {
+        t = chip;
+        chip = chip->t_next;
+        if (t->dtb_file)
+            free(t->dtb_file);
+        free(t->dtb_data);
+        free(t);
     }
+}
 
-    if (line)
-        free(line);
+static void chip_free_ids(struct chipId_t *chipId, struct chipSt_t *chipSt,
+                          struct chipPt_t *chipPt)
+{
+    void *t;
 
-    if (count1 == 0) {
-        log_err("... skip, incorrect '%s' format\n", dt_tag);
-        return NULL;
-    }
-    if (count2 == 0) {
-        log_err("... skip, incorrect '%s' format\n", QCDT_BOARD_TAG);
-        return NULL;
+    while (chipId) {
+        t = chipId;
+        chipId = chipId->t_next;
+        free(t);
     }
-    if (count3 == 0 && msmversion == 3) {
-        log_err("... skip, incorrect '%s' format\n", QCDT_PMIC_TAG);
-        return NULL;
+    while (chipSt) {
+        t = chipSt;
+        chipSt = chipSt->t_next;
+        free(t);
     }
-    if (motorola_version && model == NULL) {
-        log_err("... skip, property '%s' not found\n", QCDT_MODEL_TAG);
-        return NULL;
+    while (chipPt) {
+        t = chipPt;
+        chipPt = chipPt->t_next;
+        free(t);
     }
+}
+
+/* Build the msm-id x board-id (x pmic-id for v3) entries of one DTB */
+static struct chipInfo_t *chip_expand(struct chipId_t *cId,
+                                      struct chipSt_t *cSt,
+                                      struct chipPt_t *cPt,
+                                      const char *model,
+                                      uint32_t msmversion)
+{
+    struct chipInfo_t *chip = NULL, *tmp;
+    struct chipSt_t *tmp_st = cSt;
+    struct chipPt_t *tmp_pt = cPt;
 
-    tmp_st = cSt;
-    tmp_pt = cPt;
     while (cId != NULL) {
         while (cSt != NULL) {
             if (msmversion == 3) {
@@ -616,6 +691,7 @@ struct chipInfo_t *getChipInfo(const char *filename, int *num, uint32_t msmversi
                     tmp->pmic_model[3] = cPt->pmic3;
                     tmp->dtb_size = 0;
                     tmp->dtb_file = NULL;
+                    tmp->dtb_data = NULL;
                     tmp->master   = chip;
                     tmp->wroteDtb = 0;
                     tmp->master_offset = 0;
@@ -652,6 +728,7 @@ struct chipInfo_t *getChipInfo(const char *filename, int *num, uint32_t msmversi
                 tmp->pmic_model[3] = 0;
                 tmp->dtb_size = 0;
                 tmp->dtb_file = NULL;
+                tmp->dtb_data = NULL;
                 tmp->master   = chip;
                 tmp->wroteDtb = 0;
                 tmp->master_offset = 0;
@@ -662,249 +739,2131 @@ struct chipInfo_t *getChipInfo(const char *filename, int *num, uint32_t msmversi
         cId = cId->t_next;
     }
 
-    if (msmversion == 2)
-        entryEndedPT = 1;
+    return chip;
+}
 
-    /* clear memory*/
-    pclose(pfile);
-    while (chipId) {
-        chipId_tmp = chipId;
-        chipId = chipId->t_next;
-        free(chipId_tmp);
-    }
-    while (chipSt) {
-        chipSt_tmp= chipSt;
-        chipSt = chipSt->t_next;
-        free(chipSt_tmp);
-    }
+/*
+  For v1 Extract 'qcom,msm-id' parameter triplet from DTB
+      qcom,msm-id = <x y z>;
+
+  For v2 Extract 'qcom,msm-id', 'qcom,board-id' parameter double from DTB
+      qcom,msm-id = <x z> i.e chipset, revision number;
+      qcom,board-id = <y y'> i.e platform and sub-type;
+ */
+
+struct chipInfo_t *getChipInfo(FILE *dts, struct dtbInfo_t *info)
+{
+    char *pos;
+    char *line = NULL;
+    size_t line_size;
+    uint32_t msmversion = info->version;
+    int found_model = 0;
+    int llen;
+    struct chipInfo_t *chip = NULL, *tmp;
+    uint32_t data[3] = {0, 0, 0};
+    uint32_t data_st[2] = {0, 0};
+    uint32_t data_pt[4] = {0, 0, 0, 0};
+    char *tok, *sptr = NULL;
+    int i, entryValid, entryEnded;
+    int count = 0, count1 = 0, count2 = 0, count3 = 0;
+    int entryValidST, entryEndedST, entryValidDT, entryEndedDT, entryValidPT, entryEndedPT;
+    struct chipId_t *chipId = NULL, *cId = NULL, *tmp_id = NULL;
+    struct chipSt_t *chipSt = NULL, *cSt = NULL, *tmp_st = NULL;
+    struct chipPt_t *chipPt = NULL, *cPt = NULL, *tmp_pt = NULL;
+
+    line_size = 1024;
+    line = (char *)malloc(line_size);
+    if (!line) {
+        log_err("Out of memory\n");
+        return NULL;
+    }
+
+    /* Find "qcom,msm-id" */
+    while ((llen = getline(&line, &line_size, dts)) != -1) {
+        if (msmversion == 1) {
+            if ((pos = strstr(line, dt_tag)) != NULL) {
+                pos += strlen(dt_tag);
+
+                entryEnded = 0;
+                while (1) {
+                    entryValid = 1;
+                    for (i = 0; i < 3; i++) {
+                        tok = strtok_r(pos, " \t", &sptr);
+                        pos = NULL;
+                        if (tok != NULL) {
+                            if (*tok == '>') {
+                                entryEnded = 1;
+                                entryValid = 0;
+                                break;
+                            }
+                            data[i] = strtoul(tok, NULL, 0);
+                        } else {
+                            data[i] = 0;
+                            entryValid = 0;
+                            entryEnded = 1;
+                        }
+                    }
+                    if (entryEnded) {
+                        free(line);
+                        info->num = count;
+                        return chip;
+                    }
+                    if (entryValid) {
+                        tmp = (struct chipInfo_t *)
+                                  malloc(sizeof(struct chipInfo_t));
+                        if (!tmp) {
+                            log_err("Out of memory\n");
+                            break;
+                        }
+                        if (!chip) {
+                            chip = tmp;
+                            chip->t_next = NULL;
+                        } else {
+                            tmp->t_next = chip->t_next;
+                            chip->t_next = tmp;
+                        }
+                        tmp->chipset  = data[0];
+                        tmp->platform = data[1];
+                        tmp->subtype  = 0;
+                        tmp->revNum   = data[2];
+                        tmp->pmic_model[0] = 0;
+                        tmp->pmic_model[1] = 0;
+                        tmp->pmic_model[2] = 0;
+                        tmp->pmic_model[3] = 0;
+                        tmp->dtb_size = 0;
+                        tmp->dtb_file = NULL;
+                        tmp->dtb_data = NULL;
+                        tmp->master   = chip;
+                        tmp->wroteDtb = 0;
+                        tmp->master_offset = 0;
+                        count++;
+                    }
+                }
+
+                log_err("... skip, incorrect '%s' format\n", dt_tag);
+                break;
+            }
+        } else if (msmversion == 2 || msmversion == 3) {
+            if ((pos = strstr(line, dt_tag)) != NULL) {
+                pos += strlen(dt_tag);
+
+                entryEndedDT = 0;
+                for (;entryEndedDT < 1;) {
+                    entryValidDT = 1;
+                    for (i = 0; i < 2; i++) {
+                        tok = strtok_r(pos, " \t", &sptr);
+                        pos = NULL;
+                        if (tok != NULL) {
+                            if (*tok == '>') {
+                                entryEndedDT = 1;
+                                entryValidDT = 0;
+                                break;
+                            }
+                            data_st[i] = strtoul(tok, NULL, 0);
+                        } else {
+                            data_st[i] = 0;
+                            entryValidDT = 0;
+                            entryEndedDT = 1;
+                        }
+                    }
+
+                    if (entryValidDT) {
+                        tmp_id = (struct chipId_t *)
+                                     malloc(sizeof(struct chipId_t));
+                        if (!tmp_id) {
+                            log_err("Out of memory\n");
+                            break;
+                        }
+                        if (!chipId) {
+                            chipId = tmp_id;
+                            cId = tmp_id;
+                            chipId->t_next = NULL;
+                        } else {
+                            tmp_id->t_next = chipId->t_next;
+                            chipId->t_next = tmp_id;
+                        }
+                        tmp_id->chipset = data_st[0];
+                        tmp_id->revNum= data_st[1];
+                        count1++;
+                    }
+                }
+            }
+
+            if ((pos = strstr(line,QCDT_BOARD_TAG)) != NULL) {
+                pos += strlen(QCDT_BOARD_TAG);
+                entryEndedST = 0;
+                for (;entryEndedST < 1;) {
+                    entryValidST = 1;
+                    for (i = 0; i < 2; i++) {
+                        tok = strtok_r(pos, " \t", &sptr);
+                        pos = NULL;
+                        if (tok != NULL) {
+                            if (*tok == '>') {
+                                entryEndedST = 1;
+                                entryValidST = 0;
+                                break;
+                            }
+                            data_st[i] = strtoul(tok, NULL, 0);
+                        } else {
+                            data_st[i] = 0;
+                            entryValidST = 0;
+                            entryEndedST = 1;
+                        }
+                    }
+                    if (entryValidST) {
+                        tmp_st = (struct chipSt_t *)
+                                   malloc(sizeof(struct chipSt_t));
+                        if (!tmp_st) {
+                            log_err("Out of memory\n");
+                            break;
+                        }
+
+                        if (!chipSt) {
+                            chipSt = tmp_st;
+                            cSt = tmp_st;
+                            chipSt->t_next = NULL;
+                        } else {
+                            tmp_st->t_next = chipSt->t_next;
+                            chipSt->t_next = tmp_st;
+                        }
+
+                        tmp_st->platform = data_st[0];
+                        tmp_st->subtype= data_st[1];
+                        count2++;
+                    }
+                }
+            }
+
+            if ((pos = strstr(line,QCDT_PMIC_TAG)) != NULL) {
+                pos += strlen(QCDT_PMIC_TAG);
+                entryEndedPT = 0;
+                for (;entryEndedPT < 1;) {
+                    entryValidPT = 1;
+                    for (i = 0; i < 4; i++) {
+                        tok = strtok_r(pos, " \t", &sptr);
+                        pos = NULL;
+                        if (tok != NULL) {
+                            if (*tok == '>') {
+                                entryEndedPT = 1;
+                                entryValidPT = 0;
+                                break;
+                            }
+                            data_pt[i] = strtoul(tok, NULL, 0);
+                        } else {
+                            data_pt[i] = 0;
+                            entryValidPT = 0;
+                            entryEndedPT = 1;
+                        }
+                    }
+                    if (entryValidPT) {
+                        tmp_pt = (struct chipPt_t *)
+                                   malloc(sizeof(struct chipPt_t));
+                        if (!tmp_pt) {
+                            log_err("Out of memory\n");
+                            break;
+                        }
+
+                        if (!chipPt) {
+                            chipPt = tmp_pt;
+                            cPt = tmp_pt;
+                            chipPt->t_next = NULL;
+                        } else {
+                            tmp_pt->t_next = chipPt->t_next;
+                            chipPt->t_next = tmp_pt;
+                        }
+
+                        tmp_pt->pmic0 = data_pt[0];
+                        tmp_pt->pmic1 = data_pt[1];
+                        tmp_pt->pmic2 = data_pt[2];
+                        tmp_pt->pmic3 = data_pt[3];
+                        count3++;
+                    }
+                }
+            }
+
+            if ((pos = strstr(line,QCDT_MODEL_TAG)) != NULL && strstr(line,QCDT_QCOM_MODEL_TAG) == NULL) {
+                char *model_end;
+                int model_len;
+
+                pos += strlen(QCDT_MODEL_TAG);
+
+                if ((model_end=strchr(pos, '"')) != NULL && (model_len=model_end-pos)<32) {
+                    memset(info->model, 0, sizeof(info->model));
+                    strncat(info->model, pos, model_len);
+                    found_model = 1;
+                    if (motorola_version)
+                        log_info("Found model %s\n", info->model);
+                }
+            }
+        }
+    }
+
+    if (line)
+        free(line);
+
+    if (count1 == 0) {
+        log_err("... skip, incorrect '%s' format\n", dt_tag);
+        return NULL;
+    }
+    if (count2 == 0) {
+        log_err("... skip, incorrect '%s' format\n", QCDT_BOARD_TAG);
+        return NULL;
+    }
+    if (count3 == 0 && msmversion == 3) {
+        log_err("... skip, incorrect '%s' format\n", QCDT_PMIC_TAG);
+        return NULL;
+    }
+    if (motorola_version && !found_model) {
+        log_err("... skip, property '%s' not found\n", QCDT_MODEL_TAG);
+        return NULL;
+    }
+
+    chip = chip_expand(cId, cSt, cPt, info->model, msmversion);
+
+    if (msmversion == 2)
+        entryEndedPT = 1;
+
+    /* clear memory*/
+    chip_free_ids(chipId, chipSt, chipPt);
+
+    if (entryEndedST  == 1 && entryEndedDT == 1 && entryEndedPT == 1) {
+        info->num = count1;
+        return chip;
+    }
+
+    /* clear memory*/
+    chip_free_list(chip);
+    return NULL;
+}
+
+/* Get the version-id based on dtb files */
+uint32_t GetVersionInfo(FILE *dts)
+{
+    char *pos;
+    char *line = NULL;
+    size_t line_size;
+    int llen;
+    uint32_t v = 1;
+
+    line_size = 1024;
+    line = (char *)malloc(line_size);
+    if (!line) {
+        log_err("Out of memory\n");
+        return 0;
+    }
+
+    /* Find the type of version */
+    while ((llen = getline(&line, &line_size, dts)) != -1) {
+        if ((pos = strstr(line,QCDT_BOARD_TAG)) != NULL) {
+            v = 2;
+        }
+        if ((pos = strstr(line,QCDT_PMIC_TAG)) != NULL) {
+            v = 3;
+            break;
+        }
+    }
+
+    free(line);
+    log_info("Version:%d\n", v);
+
+    return v;
+}
+
+/* Decompile a dtb with dtc and keep the dts in memory */
+static char *decompile_dtb(const char *filename, size_t *size)
+{
+    const char str1[] = "dtc -I dtb -O dts \"";
+    const char str2[] = "\" 2>&1";
+    char *buf, *dts = NULL, *tmp;
+    size_t alloc = 0, len = 0, ret;
+    FILE *pfile;
+    int llen;
+
+    llen = sizeof(char) * (strlen(dtc_path) +
+                           strlen(str1) +
+                           strlen(str2) +
+                           strlen(filename) + 1);
+    buf = (char *)malloc(llen);
+    if (!buf) {
+        log_err("Out of memory\n");
+        return NULL;
+    }
+
+    strncpy(buf, dtc_path, llen);
+    strncat(buf, str1, llen);
+    strncat(buf, filename, llen);
+    strncat(buf, str2, llen);
+
+    pfile = popen(buf, "r");
+    free(buf);
+
+    if (pfile == NULL) {
+        log_err("... skip, fail to decompile dtb\n");
+        return NULL;
+    }
+
+    do {
+        if (len == alloc) {
+            alloc = alloc ? alloc * 2 : 16384;
+            tmp = (char *)realloc(dts, alloc);
+            if (!tmp) {
+                log_err("Out of memory\n");
+                free(dts);
+                pclose(pfile);
+                return NULL;
+            }
+            dts = tmp;
+        }
+        ret = fread(dts + len, 1, alloc - len, pfile);
+        len += ret;
+    } while (ret > 0);
+    pclose(pfile);
+
+    if (len == 0) {
+        log_err("... skip, fail to decompile dtb\n");
+        free(dts);
+        return NULL;
+    }
+
+    *size = len;
+    return dts;
+}
+
+/* Read size bytes at offset of fd into memory and check the DTB header */
+static void *read_dtb(int fd, off_t offset, size_t size)
+{
+    void *fdt;
+    ssize_t ret;
+    size_t off = 0;
+
+    if (size < sizeof(struct fdt_header)) {
+        log_err("... skip, invalid dtb header\n");
+        return NULL;
+    }
+
+    fdt = malloc(size);
+    if (!fdt) {
+        log_err("Out of memory\n");
+        return NULL;
+    }
+
+    while (off < size) {
+        ret = pread(fd, (char *)fdt + off, size - off, offset + off);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        off += ret;
+    }
+
+    if (off != size) {
+        log_err("... skip, fail to read dtb\n");
+        free(fdt);
+        return NULL;
+    }
+
+    if (fdt_check_header(fdt) != 0 || fdt_totalsize(fdt) > off) {
+        log_err("... skip, invalid dtb header\n");
+        free(fdt);
+        return NULL;
+    }
+
+    return fdt;
+}
+
+static void *load_dtb(const char *filename, size_t *size)
+{
+    struct stat st;
+    void *fdt;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        log_err("... skip, fail to open dtb\n");
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        log_err("... skip, fail to get dtb size\n");
+        close(fd);
+        return NULL;
+    }
+
+    fdt = read_dtb(fd, 0, st.st_size);
+    close(fd);
+
+    *size = st.st_size;
+
+    return fdt;
+}
+
+/* Return the cells of a property, NULL unless it holds whole u32 cells */
+static const fdt32_t *fdt_getcells(const void *fdt, int node,
+                                   const char *name, int *count)
+{
+    const fdt32_t *cells;
+    int len;
+
+    *count = 0;
+    cells = fdt_getprop(fdt, node, name, &len);
+    if (!cells || len <= 0 || (len % sizeof(fdt32_t)) != 0)
+        return NULL;
+
+    *count = len / sizeof(fdt32_t);
+    return cells;
+}
+
+/*
+  Same as GetVersionInfo() and getChipInfo() combined, but reads the root
+  properties of an in-memory dtb with libfdt instead of parsing the
+  output of dtc.
+ */
+struct chipInfo_t *getChipInfoFdt(const void *fdt, struct dtbInfo_t *info)
+{
+    const fdt32_t *cells, *board_cells, *pmic_cells;
+    const char *model;
+    int root, ncells, board_ncells, pmic_ncells, len, i;
+    int count = 0, count1 = 0, count2 = 0, count3 = 0;
+    int found_model = 0;
+    uint32_t msmversion;
+    struct chipInfo_t *chip = NULL, *tmp;
+    struct chipId_t *chipId = NULL, *tmp_id;
+    struct chipSt_t *chipSt = NULL, *tmp_st;
+    struct chipPt_t *chipPt = NULL, *tmp_pt;
+
+    root = fdt_path_offset(fdt, "/");
+    if (root < 0) {
+        info->version = 1;
+        log_info("Version:%d\n", info->version);
+        log_err("... skip, fail to find root node\n");
+        return NULL;
+    }
+
+    cells = fdt_getcells(fdt, root, dt_prop, &ncells);
+    board_cells = fdt_getcells(fdt, root, QCDT_BOARD_PROP, &board_ncells);
+    pmic_cells = fdt_getcells(fdt, root, QCDT_PMIC_PROP, &pmic_ncells);
+
+    /* Find the type of version */
+    if (pmic_cells)
+        msmversion = 3;
+    else if (board_cells)
+        msmversion = 2;
+    else
+        msmversion = 1;
+    info->version = msmversion;
+    log_info("Version:%d\n", msmversion);
+
+    model = fdt_getprop(fdt, root, QCDT_MODEL_PROP, &len);
+    /* must be a string which fits into chipInfo_t.model */
+    if (model && len > 0 && len <= (int)sizeof(info->model) &&
+        model[len - 1] == '\0' && strlen(model) == (size_t)(len - 1)) {
+        memcpy(info->model, model, len);
+        found_model = 1;
+    }
+
+    if (msmversion == 1) {
+        for (i = 0; i + 3 <= ncells; i += 3) {
+            tmp = (struct chipInfo_t *)malloc(sizeof(struct chipInfo_t));
+            if (!tmp) {
+                log_err("Out of memory\n");
+                chip_free_list(chip);
+                return NULL;
+            }
+            if (!chip) {
+                chip = tmp;
+                chip->t_next = NULL;
+            } else {
+                tmp->t_next = chip->t_next;
+                chip->t_next = tmp;
+            }
+            tmp->chipset  = fdt32_to_cpu(cells[i]);
+            tmp->platform = fdt32_to_cpu(cells[i + 1]);
+            tmp->subtype  = 0;
+            tmp->revNum   = fdt32_to_cpu(cells[i + 2]);
+            memset(tmp->model, 0, sizeof(tmp->model));
+            tmp->pmic_model[0] = 0;
+            tmp->pmic_model[1] = 0;
+            tmp->pmic_model[2] = 0;
+            tmp->pmic_model[3] = 0;
+            tmp->dtb_size = 0;
+            tmp->dtb_file = NULL;
+            tmp->dtb_data = NULL;
+            tmp->master   = chip;
+            tmp->wroteDtb = 0;
+            tmp->master_offset = 0;
+            count++;
+        }
+
+        if (count == 0)
+            log_err("... skip, incorrect '%s' format\n", dt_tag);
+        info->num = count;
+        return chip;
+    }
+
+    for (i = 0; i + 2 <= ncells; i += 2) {
+        tmp_id = (struct chipId_t *)malloc(sizeof(struct chipId_t));
+        if (!tmp_id) {
+            log_err("Out of memory\n");
+            goto out;
+        }
+        if (!chipId) {
+            chipId = tmp_id;
+            chipId->t_next = NULL;
+        } else {
+            tmp_id->t_next = chipId->t_next;
+            chipId->t_next = tmp_id;
+        }
+        tmp_id->chipset = fdt32_to_cpu(cells[i]);
+        tmp_id->revNum  = fdt32_to_cpu(cells[i + 1]);
+        count1++;
+    }
+
+    cells = board_cells;
+    for (i = 0; i + 2 <= board_ncells; i += 2) {
+        tmp_st = (struct chipSt_t *)malloc(sizeof(struct chipSt_t));
+        if (!tmp_st) {
+            log_err("Out of memory\n");
+            goto out;
+        }
+        if (!chipSt) {
+            chipSt = tmp_st;
+            chipSt->t_next = NULL;
+        } else {
+            tmp_st->t_next = chipSt->t_next;
+            chipSt->t_next = tmp_st;
+        }
+        tmp_st->platform = fdt32_to_cpu(cells[i]);
+        tmp_st->subtype  = fdt32_to_cpu(cells[i + 1]);
+        count2++;
+    }
+
+    cells = pmic_cells;
+    for (i = 0; i + 4 <= pmic_ncells; i += 4) {
+        tmp_pt = (struct chipPt_t *)malloc(sizeof(struct chipPt_t));
+        if (!tmp_pt) {
+            log_err("Out of memory\n");
+            goto out;
+        }
+        if (!chipPt) {
+            chipPt = tmp_pt;
+            chipPt->t_next = NULL;
+        } else {
+            tmp_pt->t_next = chipPt->t_next;
+            chipPt->t_next = tmp_pt;
+        }
+        tmp_pt->pmic0 = fdt32_to_cpu(cells[i]);
+        tmp_pt->pmic1 = fdt32_to_cpu(cells[i + 1]);
+        tmp_pt->pmic2 = fdt32_to_cpu(cells[i + 2]);
+        tmp_pt->pmic3 = fdt32_to_cpu(cells[i + 3]);
+        count3++;
+    }
+
+    if (motorola_version && found_model)
+        log_info("Found model %s\n", info->model);
+
+    if (count1 == 0) {
+        log_err("... skip, incorrect '%s' format\n", dt_tag);
+        goto out;
+    }
+    if (count2 == 0) {
+        log_err("... skip, incorrect '%s' format\n", QCDT_BOARD_TAG);
+        goto out;
+    }
+    if (count3 == 0 && msmversion == 3) {
+        log_err("... skip, incorrect '%s' format\n", QCDT_PMIC_TAG);
+        goto out;
+    }
+    if (motorola_version && !found_model) {
+        log_err("... skip, property '%s' not found\n", QCDT_MODEL_TAG);
+        goto out;
+    }
+
+    chip = chip_expand(chipId, chipSt, chipPt, info->model, msmversion);
+    info->num = count1;
+
+out:
+    chip_free_ids(chipId, chipSt, chipPt);
+    return chip;
+}
+
+/* Hash the contents of a file */
+static int hash_file(const char *filename, uint8_t *hash)
+{
+    char buf[COPY_BLK];
+    sha256_ctx_t ctx;
+    FILE *f;
+    size_t n;
+
+    f = fopen(filename, "r");
+    if (!f)
+        return RC_ERROR;
+
+    sha256_init(&ctx);
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        sha256_update(&ctx, buf, n);
+    if (ferror(f)) {
+        fclose(f);
+        return RC_ERROR;
+    }
+    fclose(f);
+
+    sha256_final(&ctx, hash);
+    return RC_SUCCESS;
+}
+
+/*
+  Classify one DTB: detect the QCDT version it needs, its entries and its
+  model with a single parse of the file.
+ */
+static int classify_dtb(const char *filename, struct dtbInfo_t *info)
+{
+    char *dts;
+    size_t size;
+    FILE *f;
+    void *fdt;
+
+    memset(info, 0, sizeof(*info));
+
+    if (!use_dtc) {
+        fdt = load_dtb(filename, &size);
+        if (!fdt)
+            return RC_ERROR;
+
+        if (cache_file)
+            sha256(fdt, size, info->hash);
+        info->chip = getChipInfoFdt(fdt, info);
+        free(fdt);
+        return RC_SUCCESS;
+    }
+
+    if (cache_file && hash_file(filename, info->hash) != RC_SUCCESS) {
+        log_err("... skip, fail to read dtb\n");
+        return RC_ERROR;
+    }
+
+    dts = decompile_dtb(filename, &size);
+    if (!dts)
+        return RC_ERROR;
+
+    f = fmemopen(dts, size, "r");
+    if (!f) {
+        log_err("Out of memory\n");
+        free(dts);
+        return RC_ERROR;
+    }
+
+    info->version = GetVersionInfo(f);
+    rewind(f);
+    info->chip = getChipInfo(f, info);
+
+    fclose(f);
+    free(dts);
+    return RC_SUCCESS;
+}
+
+/*
+  The cache maps the path of a DTB to the results of classify_dtb() and
+  the messages it logged.  A record is reused if size and mtime of the
+  file still match, or if only the mtime changed but the contents hash to
+  the same value.  Every run writes a new cache with the records of the
+  DTBs it has seen, so deleted files are pruned.  The whole cache is
+  dropped if the options the results depend on changed, the dtc binary
+  given with --dtc-path included.
+ */
+static size_t cache_hash_path(const char *path)
+{
+    size_t h = 2166136261u;
+
+    while (*path)
+        h = (h ^ (uint8_t)*path++) * 16777619u;
+    return h;
+}
+
+static struct dtbCache_t *cache_lookup(const char *path)
+{
+    struct dtbCache_t *c;
+    size_t i;
+
+    if (!cache_table)
+        return NULL;
+
+    for (i = cache_hash_path(path) & (cache_table_size - 1);
+         (c = cache_table[i]) != NULL;
+         i = (i + 1) & (cache_table_size - 1)) {
+        if (!strcmp(c->path, path))
+            return c;
+    }
+    return NULL;
+}
+
+/* Read the cache, a missing or unusable one is just empty */
+static void cache_load(void)
+{
+    struct dtbCacheHdr_t hdr;
+    struct dtbCache_t *c;
+    struct stat st;
+    size_t off, i, j, count;
+    ssize_t n;
+    int fd;
+
+    fd = open(cache_file, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(hdr)) {
+        close(fd);
+        return;
+    }
+
+    cache_buf = (char *)malloc(st.st_size);
+    if (!cache_buf) {
+        close(fd);
+        return;
+    }
+
+    for (off = 0; off < (size_t)st.st_size; off += n) {
+        n = read(fd, cache_buf + off, st.st_size - off);
+        if (n <= 0)
+            break;
+    }
+    close(fd);
+    if (off != (size_t)st.st_size)
+        goto invalid;
+
+    memcpy(&hdr, cache_buf, sizeof(hdr));
+    off = sizeof(hdr);
+    if (memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic)) ||
+        hdr.version != CACHE_VERSION ||
+        hdr.motorola_version != (uint32_t)motorola_version ||
+        hdr.use_dtc != (uint32_t)use_dtc ||
+        hdr.dt_tag_len != strlen(dt_tag) ||
+        hdr.dt_tag_len > st.st_size - off ||
+        memcmp(cache_buf + off, dt_tag, hdr.dt_tag_len))
+        goto invalid;
+    off += hdr.dt_tag_len;
+    if (hdr.dtc_path_len != strlen(dtc_path) ||
+        hdr.dtc_path_len > st.st_size - off ||
+        memcmp(cache_buf + off, dtc_path, hdr.dtc_path_len))
+        goto invalid;
+    off += hdr.dtc_path_len;
+
+    /* every record takes at least its header */
+    if (hdr.count > (st.st_size - off) / sizeof(struct dtbCacheRec_t))
+        goto invalid;
+
+    count = hdr.count;
+    cache_recs = (struct dtbCache_t *)calloc(count, sizeof(*cache_recs));
+    if (!cache_recs)
+        goto invalid;
+
+    for (i = 0; i < count; i++) {
+        c = &cache_recs[i];
+        if (st.st_size - off < sizeof(c->rec))
+            goto invalid;
+        memcpy(&c->rec, cache_buf + off, sizeof(c->rec));
+        off += sizeof(c->rec);
+
+        if (c->rec.path_len == 0 ||
+            c->rec.path_len > st.st_size - off ||
+            cache_buf[off + c->rec.path_len - 1] != '\0')
+            goto invalid;
+        c->path = cache_buf + off;
+        off += c->rec.path_len;
+
+        if (c->rec.log_len > st.st_size - off)
+            goto invalid;
+        c->log = cache_buf + off;
+        off += c->rec.log_len;
+
+        if (c->rec.count > (st.st_size - off) / sizeof(struct dtbCacheEntry_t))
+            goto invalid;
+        c->entries = (const uint8_t *)cache_buf + off;
+        off += c->rec.count * sizeof(struct dtbCacheEntry_t);
+    }
+
+    cache_table_size = 16;
+    while (cache_table_size < count * 2)
+        cache_table_size *= 2;
+    cache_table = (struct dtbCache_t **)calloc(cache_table_size,
+                                               sizeof(*cache_table));
+    if (!cache_table)
+        goto invalid;
+
+    for (i = 0; i < count; i++) {
+        for (j = cache_hash_path(cache_recs[i].path) & (cache_table_size - 1);
+             cache_table[j] != NULL;
+             j = (j + 1) & (cache_table_size - 1))
+            ;
+        cache_table[j] = &cache_recs[i];
+    }
+    return;
+
+invalid:
+    free(cache_table);
+    free(cache_recs);
+    free(cache_buf);
+    cache_table = NULL;
+    cache_recs = NULL;
+    cache_buf = NULL;
+}
+
+static void cache_free(void)
+{
+    free(cache_table);
+    free(cache_recs);
+    free(cache_buf);
+    cache_table = NULL;
+    cache_recs = NULL;
+    cache_buf = NULL;
+}
+
+/* Check a record against the current state of the file */
+static int cache_valid(struct dtbCache_t *c, const char *filename,
+                       const struct stat *st)
+{
+    uint8_t hash[SHA256_DIGEST_SIZE];
+
+    if (c->rec.size != (uint64_t)st->st_size)
+        return 0;
+
+    if (c->rec.mtime_sec == st->st_mtim.tv_sec &&
+        c->rec.mtime_nsec == st->st_mtim.tv_nsec)
+        return 1;
+
+    return hash_file(filename, hash) == RC_SUCCESS &&
+           !memcmp(hash, c->rec.hash, sizeof(hash));
+}
+
+/* Rebuild the results of classify_dtb() from a record */
+static int cache_restore(struct dtbCache_t *c, struct dtbInfo_t *info)
+{
+    struct dtbCacheEntry_t e;
+    struct chipInfo_t *chip, *last = NULL;
+    uint32_t i;
+
+    memset(info, 0, sizeof(*info));
+    info->version = c->rec.version;
+    info->num = c->rec.num;
+    memcpy(info->model, c->rec.model, sizeof(info->model));
+    memcpy(info->hash, c->rec.hash, sizeof(info->hash));
+
+    for (i = 0; i < c->rec.count; i++) {
+        chip = (struct chipInfo_t *)calloc(1, sizeof(struct chipInfo_t));
+        if (!chip) {
+            log_err("Out of memory\n");
+            chip_free_list(info->chip);
+            info->chip = NULL;
+            return RC_ERROR;
+        }
+
+        memcpy(&e, c->entries + i * sizeof(e), sizeof(e));
+        chip->chipset  = e.chipset;
+        chip->platform = e.platform;
+        chip->subtype  = e.subtype;
+        chip->revNum   = e.revNum;
+        memcpy(chip->pmic_model, e.pmic_model, sizeof(chip->pmic_model));
+        /* v1 entries don't carry the model, see getChipInfoFdt() */
+        if (motorola_version && info->version >= 2)
+            memcpy(chip->model, info->model, sizeof(chip->model));
+
+        if (last)
+            last->t_next = chip;
+        else
+            info->chip = chip;
+        chip->master = info->chip;
+        last = chip;
+    }
+
+    fwrite(c->log, 1, c->rec.log_len, log_file ? log_file : log_out);
+    return RC_SUCCESS;
+}
+
+/* Make a record of the results of classify_dtb() */
+static struct dtbCache_t *cache_record(const char *filename,
+                                       const struct stat *st,
+                                       const struct dtbInfo_t *info,
+                                       const char *log, size_t log_len)
+{
+    struct dtbCacheEntry_t e;
+    struct chipInfo_t *chip;
+    struct dtbCache_t *c;
+    size_t path_len = strlen(filename) + 1;
+    uint32_t count = 0;
+    uint8_t *p;
+
+    for (chip = info->chip; chip; chip = chip->t_next)
+        count++;
+
+    c = (struct dtbCache_t *)malloc(sizeof(*c) + path_len + log_len +
+                                    count * sizeof(e));
+    if (!c)
+        return NULL;
+
+    memset(&c->rec, 0, sizeof(c->rec));
+    c->rec.size = st->st_size;
+    c->rec.mtime_sec = st->st_mtim.tv_sec;
+    c->rec.mtime_nsec = st->st_mtim.tv_nsec;
+    memcpy(c->rec.hash, info->hash, sizeof(c->rec.hash));
+    memcpy(c->rec.model, info->model, sizeof(c->rec.model));
+    c->rec.version = info->version;
+    c->rec.num = info->num;
+    c->rec.path_len = path_len;
+    c->rec.log_len = log_len;
+    c->rec.count = count;
+
+    p = (uint8_t *)(c + 1);
+    memcpy(p, filename, path_len);
+    c->path = (const char *)p;
+    p += path_len;
+    memcpy(p, log, log_len);
+    c->log = (const char *)p;
+    p += log_len;
+    c->entries = p;
+
+    for (chip = info->chip; chip; chip = chip->t_next) {
+        e.chipset  = chip->chipset;
+        e.platform = chip->platform;
+        e.subtype  = chip->subtype;
+        e.revNum   = chip->revNum;
+        memcpy(e.pmic_model, chip->pmic_model, sizeof(e.pmic_model));
+        memcpy(p, &e, sizeof(e));
+        p += sizeof(e);
+    }
+
+    return c;
+}
+
+/* Write the records of all jobs to a new cache, replacing the old one */
+static void cache_save(struct dtbJob_t *jobs)
+{
+    struct dtbCacheHdr_t hdr;
+    struct dtbJob_t *job;
+    char tmp[PATH_MAX];
+    FILE *f;
+    int ok;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = CACHE_VERSION;
+    hdr.motorola_version = motorola_version;
+    hdr.use_dtc = use_dtc;
+    hdr.dt_tag_len = strlen(dt_tag);
+    hdr.dtc_path_len = strlen(dtc_path);
+    for (job = jobs; job; job = job->next) {
+        if (job->cache)
+            hdr.count++;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cache_file);
+    f = fopen(tmp, "w");
+    if (!f) {
+        log_err("Cannot create '%s'\n", tmp);
+        return;
+    }
+
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+         fwrite(dt_tag, 1, hdr.dt_tag_len, f) == hdr.dt_tag_len &&
+         fwrite(dtc_path, 1, hdr.dtc_path_len, f) == hdr.dtc_path_len;
+    for (job = jobs; ok && job; job = job->next) {
+        if (!job->cache)
+            continue;
+        ok = fwrite(&job->cache->rec, sizeof(job->cache->rec), 1, f) == 1 &&
+             fwrite(job->cache->path, 1, job->cache->rec.path_len, f) ==
+                job->cache->rec.path_len &&
+             fwrite(job->cache->log, 1, job->cache->rec.log_len, f) ==
+                job->cache->rec.log_len &&
+             fwrite(job->cache->entries, sizeof(struct dtbCacheEntry_t),
+                    job->cache->rec.count, f) == job->cache->rec.count;
+    }
+
+    if (fclose(f) != 0 || !ok || rename(tmp, cache_file) != 0) {
+        log_err("Failed to write cache '%s'\n", cache_file);
+        unlink(tmp);
+    }
+}
 
-    while (chipPt) {
-        chipPt_tmp= chipPt;
-        chipPt = chipPt->t_next;
-        free(chipPt_tmp);
+/* Classify a streamed DTB from the spool file */
+static int classify_spooled(const void *data, off_t offset, size_t size,
+                            struct dtbInfo_t *info)
+{
+    void *fdt = NULL;
+
+    memset(info, 0, sizeof(*info));
+
+    if (!data) {
+        fdt = read_dtb(spool_fd, offset, size);
+        if (!fdt)
+            return RC_ERROR;
+        data = fdt;
+    }
+
+    info->chip = getChipInfoFdt(data, info);
+    free(fdt);
+    return RC_SUCCESS;
+}
+
+/* Add the entries of a classified DTB to chip_list, takes filename */
+static int add_dtb(struct dtbJob_t *job, uint32_t *version)
+{
+    char *filename = job->filename;
+    struct dtbInfo_t *info = &job->info;
+    struct chipInfo_t *chip, *t_chip;
+    struct stat st;
+    uint32_t msmversion;
+    int dtb_count = 0;
+    int rc;
+
+    msmversion = info->version;
+    if (*version < msmversion) {
+        *version = msmversion;
+    }
+
+    chip = info->chip;
+
+    if (msmversion == 1) {
+        if (!chip) {
+            log_err("skip, failed to scan for '%s' tag\n", dt_tag);
+            free(filename);
+            free(job->data);
+            return 0;
+        }
+    }
+    if (msmversion == 2) {
+        if (!chip) {
+            log_err("skip, failed to scan for '%s' or '%s' tag\n",
+                    dt_tag, QCDT_BOARD_TAG);
+            free(filename);
+            free(job->data);
+            return 0;
+        }
+    }
+    if (msmversion == 3) {
+        if (!chip) {
+            log_err("skip, failed to scan for '%s', '%s' or '%s' tag\n",
+                    dt_tag, QCDT_BOARD_TAG, QCDT_PMIC_TAG);
+            free(filename);
+            free(job->data);
+            return 0;
+        }
+    }
+
+    if (job->spooled) {
+        st.st_size = job->spool_size;
+    } else if (stat(filename, &st) != 0) {
+        st.st_size = 0;
+    }
+    if (st.st_size == 0) {
+        log_err("skip, failed to get DTB size\n");
+        free(filename);
+        free(job->data);
+        return 0;
+    }
+
+    log_info("chipset: %u, rev: %u, platform: %u, subtype: %u, pmic0: %u, pmic1: %u, pmic2: %u, pmic3: %u\n",
+             chip->chipset, chip->revNum, chip->platform, chip->subtype,
+             chip->pmic_model[0], chip->pmic_model[1], chip->pmic_model[2], chip->pmic_model[3]);
+
+    for (t_chip = chip->t_next; t_chip; t_chip = t_chip->t_next) {
+        log_info("additional chipset: %u, rev: %u, platform: %u, subtype: %u, pmic0: %u, pmic1: %u, pmic2: %u, pmic3: %u\n",
+                 t_chip->chipset, t_chip->revNum, t_chip->platform, t_chip->subtype,
+                 t_chip->pmic_model[0], t_chip->pmic_model[1], t_chip->pmic_model[2], t_chip->pmic_model[3]);
+    }
+
+    rc = chip_add(chip);
+    if (rc != RC_SUCCESS) {
+        log_err("... duplicate info, skipped\n");
+        free(filename);
+        free(job->data);
+        return 0;
+    }
+
+    dtb_count++;
+
+    chip->dtb_size = st.st_size +
+                       (page_size - (st.st_size % page_size));
+    chip->dtb_file = filename;
+    chip->dtb_spooled = job->spooled;
+    chip->dtb_spool_offset = job->spool_offset;
+    chip->dtb_spool_size = job->spool_size;
+    chip->dtb_data = job->data;
+
+    for (t_chip = chip->t_next; t_chip; t_chip = t_chip->t_next) {
+        rc = chip_add(t_chip);
+        if (rc != RC_SUCCESS) {
+            log_err("... duplicate info, skipped (chipset %u, rev: %u, platform: %u, subtype: %u\n",
+                 t_chip->chipset, t_chip->revNum, t_chip->platform, t_chip->subtype);
+            continue;
+        }
+        dtb_count++;
+    }
+
+    return dtb_count;
+}
+
+/* Monotonic time in seconds */
+static double time_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+  find_dtb() queues every DTB it discovers in directory order.  Without
+  --jobs it is classified right away, otherwise a pool of workers does
+  that.  All output is buffered per job, the log of the discovery
+  included, and printed in queue order: without --jobs as soon as the
+  job is classified, with it once all jobs before it are done.  Then the
+  entries of all DTBs are sorted at once and the jobs are merged into
+  chip_list strictly in queue order, so logs and the generated image
+  match a serial run.
+ */
+static struct dtbJob_t *job_alloc(void)
+{
+    struct dtbJob_t *job;
+
+    job = (struct dtbJob_t *)calloc(1, sizeof(struct dtbJob_t));
+    if (!job)
+        return NULL;
+
+    job->log_file = open_memstream(&job->log, &job->log_size);
+    if (!job->log_file) {
+        free(job);
+        return NULL;
+    }
+
+    return job;
+}
+
+/*
+  --efidroid: every DTB is replaced by its rewrites for EFIDroid, one per
+  chip entry, named <DTB>#<n>.  The worker of a DTB rewrites it and
+  classifies the rewrites as jobs of their own, which are linked in right
+  after it once it's done.  They only exist in memory, like spooled DTBs
+  they are copied from there into the image.
+ */
+struct efidroidCtx_t {
+    struct dtbJob_t *job;
+    struct dtbJob_t *last;
+    unsigned count;
+};
+
+static int efidroid_add(void *ctx, const void *fdt, uint32_t size,
+                        const dt_entry_local_t *entry)
+{
+    struct efidroidCtx_t *e = (struct efidroidCtx_t *)ctx;
+    struct dtbJob_t *job;
+    FILE *parent_log = log_file;
+
+    (void)entry;
+
+    job = job_alloc();
+    if (!job) {
+        log_err("Out of memory\n");
+        return -ENOMEM;
+    }
+    job->data = malloc(size);
+    if (!job->data ||
+        asprintf(&job->filename, "%s#%u", e->job->filename, e->count++) < 0) {
+        log_err("Out of memory\n");
+        fclose(job->log_file);
+        free(job->log);
+        free(job->data);
+        free(job);
+        return -ENOMEM;
+    }
+    memcpy(job->data, fdt, size);
+    job->spooled = 1;
+    job->spool_size = size;
+    job->done = 1;
+
+    log_file = job->log_file;
+    log_info("Rewrote for EFIDroid: %s ... \n", job->filename);
+    job->rc = classify_spooled(job->data, 0, size, &job->info);
+    log_file = parent_log;
+
+    if (e->last)
+        e->last->next = job;
+    else
+        e->job->rewrites = job;
+    e->last = job;
+    return 0;
+}
+
+static void efidroid_rewrite(struct dtbJob_t *job)
+{
+    struct efidroidCtx_t ctx = { job, NULL, 0 };
+    size_t size = job->spool_size;
+    void *fdt;
+
+    job->rewritten = 1;
+    job->rc = RC_ERROR;
+
+    if (job->data)
+        fdt = job->data;
+    else if (job->spooled)
+        fdt = read_dtb(spool_fd, job->spool_offset, size);
+    else
+        fdt = load_dtb(job->filename, &size);
+    if (!fdt)
+        return;
+
+    if (efidroidify_dtb(fdt, size, remove_unused_nodes, efidroid_parser,
+                        NULL, log_file ? log_file : log_out,
+                        efidroid_add, &ctx) != 0)
+        log_err("... skip, failed to rewrite '%s' for EFIDroid\n",
+                job->filename);
+
+    /* only the rewrites are needed from now on */
+    free(fdt);
+    job->data = NULL;
+}
+
+/* Link the rewrites of a finished job in after it, with job_lock held */
+static void job_link_rewrites(struct dtbJob_t *job)
+{
+    struct dtbJob_t *last;
+
+    if (!job->rewrites)
+        return;
+
+    for (last = job->rewrites; last->next; last = last->next)
+        ;
+    last->next = job->next;
+    job->next = job->rewrites;
+    job->rewrites = NULL;
+    if (job_tail == job)
+        job_tail = last;
+}
+
+/* Classify the DTB of a job, going through the cache if there is one */
+static void job_classify(struct dtbJob_t *job)
+{
+    struct dtbCache_t *c;
+    struct stat st;
+    size_t start;
+
+    if (efidroid_parser) {
+        efidroid_rewrite(job);
+        return;
+    }
+
+    if (job->spooled) {
+        job->rc = classify_spooled(job->data, job->spool_offset,
+                                   job->spool_size, &job->info);
+        return;
+    }
+
+    if (!cache_file) {
+        job->rc = classify_dtb(job->filename, &job->info);
+        return;
+    }
+
+    /* the log of the job so far is from the discovery */
+    fflush(job->log_file);
+    start = job->log_size;
+
+    if (stat(job->filename, &st) != 0) {
+        job->rc = classify_dtb(job->filename, &job->info);
+        return;
+    }
+
+    c = cache_lookup(job->filename);
+    if (c && cache_valid(c, job->filename, &st)) {
+        job->rc = cache_restore(c, &job->info);
+        job->cached = 1;
+    } else {
+        job->rc = classify_dtb(job->filename, &job->info);
+    }
+
+    if (job->rc == RC_SUCCESS) {
+        fflush(job->log_file);
+        job->cache = cache_record(job->filename, &st, &job->info,
+                                  job->log + start, job->log_size - start);
+    }
+}
+
+/* Print the buffered log of a job, once */
+static void job_flush_log(struct dtbJob_t *job)
+{
+    double start;
+
+    if (!job->log_file)
+        return;
+
+    start = time_now();
+    fclose(job->log_file);
+    job->log_file = NULL;
+    fwrite(job->log, 1, job->log_size, log_out);
+    log_bytes += job->log_size;
+    free(job->log);
+    job->log = NULL;
+    time_log += time_now() - start;
+}
+
+/* Queue a DTB for classification, takes filename and data */
+static void job_queue(char *filename, int spooled, off_t offset, size_t size,
+                      void *data)
+{
+    struct dtbJob_t *job = job_pending, *rewrite;
+
+    if (!job) {
+        free(filename);
+        free(data);
+        return;
+    }
+
+    job->filename = filename;
+    job->spooled = spooled;
+    job->spool_offset = offset;
+    job->spool_size = size;
+    job->data = data;
+
+    /* without workers, classify and print the log right away */
+    if (num_jobs <= 1) {
+        job_classify(job);
+        job->done = 1;
+        job_flush_log(job);
+        for (rewrite = job->rewrites; rewrite; rewrite = rewrite->next)
+            job_flush_log(rewrite);
+    }
+
+    /* the job takes over everything logged since the previous one */
+    job_pending = job_alloc();
+    if (!job_pending) {
+        log_err("Out of memory\n");
+        log_file = NULL;
+    } else {
+        log_file = job_pending->log_file;
+    }
+
+    pthread_mutex_lock(&job_lock);
+    if (job_tail)
+        job_tail->next = job;
+    else
+        job_head = job;
+    job_tail = job;
+    if (!job_next)
+        job_next = job;
+    if (job->done)
+        job_link_rewrites(job);
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+}
+
+static void *job_worker(void *arg)
+{
+    struct dtbJob_t *job;
+
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&job_lock);
+        while (!job_next && !job_finished)
+            pthread_cond_wait(&job_cond, &job_lock);
+        job = job_next;
+        if (job)
+            job_next = job->next;
+        pthread_mutex_unlock(&job_lock);
+
+        if (!job)
+            break;
+
+        log_file = job->log_file;
+        job_classify(job);
+        log_file = NULL;
+
+        pthread_mutex_lock(&job_lock);
+        job_link_rewrites(job);
+        job->done = 1;
+        pthread_cond_broadcast(&job_cond);
+        pthread_mutex_unlock(&job_lock);
+    }
+
+    return NULL;
+}
+
+static int find_dtb(const char *path, uint32_t *version)
+{
+    struct dirent *dp;
+    int flen;
+    char *filename;
+    int dtb_count = 0;
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        log_err("Failed to open input directory '%s'\n", path);
+        return RC_ERROR;
+    }
+
+    /* Open the .dtb files in the specified path, decompile and
+       extract "qcom,msm-id" parameter
+     */
+    while ((dp = readdir(dir)) != NULL) {
+        if (dp->d_type == DT_UNKNOWN) {
+            struct stat statbuf;
+            char name[PATH_MAX];
+            snprintf(name, sizeof(name), "%s%s%s",
+                     path,
+                     (path[strlen(path) - 1] == '/' ? "" : "/"),
+                     dp->d_name);
+            if (!stat(name, &statbuf)) {
+                if (S_ISREG(statbuf.st_mode)) {
+                    dp->d_type = DT_REG;
+                } else if (S_ISDIR(statbuf.st_mode)) {
+                    dp->d_type = DT_DIR;
+                }
+            }
+        }
+
+        if (dp->d_type == DT_DIR) {
+            char name[PATH_MAX];
+            if (dp->d_name[0] == '.') {
+                continue;
+            }
+            snprintf(name, sizeof(name), "%s%s%s%s",
+                     path,
+                     (path[strlen(path) - 1] == '/' ? "" : "/"),
+                     dp->d_name,
+                     "/");
+            log_info("Searching subdir: %s ... \n", name);
+            find_dtb(name, version);
+        } else if (dp->d_type == DT_REG) {
+            flen = strlen(dp->d_name);
+            if ((flen > 4) &&
+                (strncmp(&dp->d_name[flen-4], ".dtb", 4) == 0)) {
+                log_info("Found file: %s ... \n", dp->d_name);
+
+                flen = strlen(path) + strlen(dp->d_name) + 1;
+                filename = (char *)malloc(flen);
+                if (!filename) {
+                    log_err("Out of memory\n");
+                    break;
+                }
+                strncpy(filename, path, flen);
+                strncat(filename, dp->d_name, flen);
+
+                /* To identify the version number and chip info */
+                job_queue(filename, 0, 0, 0, NULL);
+            }
+        }
+    }
+    closedir(dir);
+    return dtb_count;
+}
+
+/*
+  Streamed input: DTBs that don't exist as files are appended to an
+  unlinked spool file as they are read, only their place in it is kept in
+  memory.  The payloads are copied from there once the table is written.
+ */
+static int spool_open(void)
+{
+    char path[PATH_MAX];
+    const char *dir = getenv("TMPDIR");
+
+    snprintf(path, sizeof(path), "%s/dtbtool.XXXXXX",
+             dir && *dir ? dir : "/tmp");
+    spool_fd = mkstemp(path);
+    if (spool_fd < 0) {
+        log_err("Cannot create spool file '%s'\n", path);
+        return RC_ERROR;
+    }
+    unlink(path);
+    spool_end = 0;
+
+    return RC_SUCCESS;
+}
+
+/* Read up to len bytes, less only at the end of the stream */
+static size_t stream_read(int fd, void *buf, size_t len)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < len) {
+        n = read(fd, (char *)buf + off, len - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        off += n;
+    }
+    return off;
+}
+
+/* Skip len bytes of the stream */
+static int stream_skip(int fd, char *buf, uint64_t len)
+{
+    size_t n;
+
+    while (len > 0) {
+        n = len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE;
+        if (stream_read(fd, buf, n) != n)
+            return RC_ERROR;
+        len -= n;
+    }
+    return RC_SUCCESS;
+}
+
+/*
+  Append a DTB to the spool file: head (already read from the stream),
+  followed by the next len - head_len bytes of the stream.
+ */
+static int spool_dtb(int fd, char *buf, const void *head, size_t head_len,
+                     size_t len)
+{
+    size_t n;
+
+    if (write(spool_fd, head, head_len) != (ssize_t)head_len)
+        return RC_ERROR;
+
+    for (len -= head_len; len > 0; len -= n) {
+        n = len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE;
+        if (stream_read(fd, buf, n) != n ||
+            write(spool_fd, buf, n) != (ssize_t)n)
+            return RC_ERROR;
+    }
+    return RC_SUCCESS;
+}
+
+/* Queue a DTB which was just spooled */
+static int spool_queue(const char *name, off_t offset)
+{
+    char *filename = strdup(name);
+
+    if (!filename) {
+        log_err("Out of memory\n");
+        return RC_ERROR;
+    }
+
+    log_info("Found file: %s ... \n", filename);
+    job_queue(filename, 1, offset, spool_end - offset, NULL);
+    return RC_SUCCESS;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* Concatenated DTBs, each one ends where its header says */
+static int read_fdt_stream(int fd, const char *name, char *buf)
+{
+    char filename[PATH_MAX];
+    uint8_t hdr[8];   /* magic, totalsize */
+    uint32_t size;
+    uint64_t pos = 0;
+    size_t n;
+
+    while ((n = stream_read(fd, hdr, sizeof(hdr))) > 0) {
+        size = get_be32(hdr + 4);
+        if (n != sizeof(hdr) || get_be32(hdr) != FDT_MAGIC ||
+            size < sizeof(struct fdt_header) || size > STREAM_DTB_MAX) {
+            log_err("Invalid DTB header in '%s' at offset %llu\n",
+                    name, (unsigned long long)pos);
+            return RC_ERROR;
+        }
+
+        if (spool_dtb(fd, buf, hdr, sizeof(hdr), size) != RC_SUCCESS) {
+            log_err("Failed to read DTB from '%s' at offset %llu\n",
+                    name, (unsigned long long)pos);
+            return RC_ERROR;
+        }
+
+        snprintf(filename, sizeof(filename), "%s@%llu",
+                 name, (unsigned long long)pos);
+        spool_end += size;
+        if (spool_queue(filename, spool_end - size) != RC_SUCCESS)
+            return RC_ERROR;
+        pos += size;
+    }
+
+    return RC_SUCCESS;
+}
+
+/* Parse an octal tar header field, -1 if it isn't one */
+static int64_t tar_octal(const char *p, size_t len)
+{
+    int64_t val = 0;
+    size_t i = 0;
+
+    while (i < len && p[i] == ' ')
+        i++;
+    if (i == len || p[i] < '0' || p[i] > '7')
+        return -1;
+    for (; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+        val = (val << 3) | (p[i] - '0');
+    if (i < len && p[i] != ' ' && p[i] != '\0')
+        return -1;
+
+    return val;
+}
+
+/* Find the 'path' record of a pax extended header */
+static void tar_pax_path(const char *pax, size_t len, char *name, size_t size)
+{
+    const char *rec, *key, *end = pax + len;
+    unsigned long rec_len;
+    char *p;
+
+    for (rec = pax; rec < end; rec += rec_len) {
+        rec_len = strtoul(rec, &p, 10);
+        if (rec_len == 0 || (size_t)(end - rec) < rec_len || *p != ' ')
+            return;
+        key = p + 1;
+        if (!strncmp(key, "path=", 5) &&
+            (size_t)(rec + rec_len - 1 - (key + 5)) < size) {
+            memcpy(name, key + 5, rec + rec_len - 1 - (key + 5));
+            name[rec + rec_len - 1 - (key + 5)] = '\0';
+        }
     }
+}
 
-    if (model)
-        free(model);
+/*
+  ustar/GNU/pax tar archive, regular files ending in .dtb are used.
+  GNU long names and pax 'path' records are supported.
+ */
+static int read_tar_stream(int fd, const char *name, char *buf)
+{
+    char hdr[512];
+    char filename[PATH_MAX];
+    char long_name[PATH_MAX] = "";
+    int64_t size, chksum;
+    uint64_t pos = 0;
+    size_t n, len;
+    int i, sum;
+
+    while ((n = stream_read(fd, hdr, sizeof(hdr))) > 0) {
+        if (n != sizeof(hdr)) {
+            log_err("Truncated tar header in '%s' at offset %llu\n",
+                    name, (unsigned long long)pos);
+            return RC_ERROR;
+        }
 
-    if (entryEndedST  == 1 && entryEndedDT == 1 && entryEndedPT == 1) {
-        *num = count1;
-        return chip;
-    }
+        /* end of archive */
+        if (hdr[0] == '\0')
+            break;
 
-    /* clear memory*/
-    while (chip) {
-        chip_t = chip;
-        chip = chip->next;
-        if (chip_t->dtb_file)
-            free(chip_t->dtb_file);
-        free(chip_t);
+        for (sum = 0, i = 0; i < (int)sizeof(hdr); i++)
+            sum += (i >= 148 && i < 156) ? ' ' : (uint8_t)hdr[i];
+        size = tar_octal(hdr + 124, 12);
+        chksum = tar_octal(hdr + 148, 8);
+        if (size < 0 || chksum != sum) {
+            log_err("Invalid tar header in '%s' at offset %llu\n",
+                    name, (unsigned long long)pos);
+            return RC_ERROR;
+        }
+        pos += sizeof(hdr);
+
+        if (long_name[0]) {
+            snprintf(filename, sizeof(filename), "%s", long_name);
+            long_name[0] = '\0';
+        } else if (!memcmp(hdr + 257, "ustar", 5) && hdr[345]) {
+            snprintf(filename, sizeof(filename), "%.155s/%.100s",
+                     hdr + 345, hdr);
+        } else {
+            snprintf(filename, sizeof(filename), "%.100s", hdr);
+        }
+
+        len = strlen(filename);
+        if ((hdr[156] == 'L' || hdr[156] == 'x') && size < COPY_BUF_SIZE) {
+            /* name of the next member */
+            if (stream_read(fd, buf, size) != (size_t)size)
+                goto truncated;
+            if (hdr[156] == 'L') {
+                len = (size_t)size < sizeof(long_name) ?
+                      (size_t)size : sizeof(long_name) - 1;
+                memcpy(long_name, buf, len);
+                long_name[len] = '\0';
+            } else {
+                tar_pax_path(buf, size, long_name, sizeof(long_name));
+            }
+        } else if ((hdr[156] == '0' || hdr[156] == '\0') &&
+                   len > 4 && !strcmp(filename + len - 4, ".dtb")) {
+            if (size < (int64_t)sizeof(struct fdt_header) ||
+                size > STREAM_DTB_MAX) {
+                log_info("Found file: %s ... \n", filename);
+                log_err("... skip, invalid dtb header\n");
+                if (stream_skip(fd, buf, size) != RC_SUCCESS)
+                    goto truncated;
+            } else {
+                if (spool_dtb(fd, buf, NULL, 0, size) != RC_SUCCESS)
+                    goto truncated;
+                spool_end += size;
+                if (spool_queue(filename, spool_end - size) != RC_SUCCESS)
+                    return RC_ERROR;
+            }
+        } else if (stream_skip(fd, buf, size) != RC_SUCCESS) {
+            goto truncated;
+        }
+        pos += size;
+
+        /* members are padded to whole blocks */
+        n = (sizeof(hdr) - size % sizeof(hdr)) % sizeof(hdr);
+        if (stream_skip(fd, buf, n) != RC_SUCCESS)
+            goto truncated;
+        pos += n;
     }
-    return NULL;
+
+    return RC_SUCCESS;
+
+truncated:
+    log_err("Truncated tar member '%s' in '%s'\n", filename, name);
+    return RC_ERROR;
 }
 
-/* Get the version-id based on dtb files */
-uint32_t GetVersionInfo(const char *filename)
+/* NUL separated list of paths */
+static int read_list_stream(int fd)
 {
-    const char str1[] = "dtc -I dtb -O dts \"";
-    const char str2[] = "\" 2>&1";
-    char *buf, *pos;
-    char *line = NULL;
-    size_t line_size;
-    FILE *pfile;
-    int llen;
-    uint32_t v = 1;
+    char *line = NULL, *filename;
+    size_t cap = 0;
+    ssize_t len;
+    FILE *f;
 
-    line_size = 1024;
-    line = (char *)malloc(line_size);
-    if (!line) {
+    f = fdopen(dup(fd), "r");
+    if (!f) {
         log_err("Out of memory\n");
-        return 0;
+        return RC_ERROR;
     }
 
-    llen = sizeof(char) * (strlen(dtc_path) +
-                           strlen(str1) +
-                           strlen(str2) +
-                           strlen(filename) + 1);
-    buf = (char *)malloc(llen);
-    if (!buf) {
+    while ((len = getdelim(&line, &cap, '\0', f)) > 0) {
+        if (line[len - 1] != '\0')
+            line[len] = '\0';
+        if (!line[0])
+            continue;
+
+        filename = strdup(line);
+        if (!filename) {
+            log_err("Out of memory\n");
+            break;
+        }
+        log_info("Found file: %s ... \n", filename);
+        job_queue(filename, 0, 0, 0, NULL);
+    }
+
+    free(line);
+    fclose(f);
+    return RC_SUCCESS;
+}
+
+/* A DTB found in a kernel image, copied as it may not be aligned */
+struct kernelCtx_t {
+    const char *name;
+    unsigned count;
+};
+
+static int kernel_add(void *ctx, const void *fdt, uint32_t size)
+{
+    struct kernelCtx_t *k = (struct kernelCtx_t *)ctx;
+    char *filename;
+    void *data;
+
+    data = malloc(size);
+    if (!data || asprintf(&filename, "%s:%u.dtb", k->name, k->count++) < 0) {
         log_err("Out of memory\n");
-        free(line);
-        return 0;
+        free(data);
+        return -ENOMEM;
     }
+    memcpy(data, fdt, size);
 
-    strncpy(buf, dtc_path, llen);
-    strncat(buf, str1, llen);
-    strncat(buf, filename, llen);
-    strncat(buf, str2, llen);
+    log_info("Found file: %s ... \n", filename);
+    job_queue(filename, 1, 0, size, data);
+    return 0;
+}
 
-    pfile = popen(buf, "r");
-    free(buf);
+/*
+  DTBs in a kernel image, see fdtscan.h.  Files are mapped, pipes are
+  read into memory as a whole.  The DTBs are kept in memory, not spooled.
+ */
+static int read_kernel_stream(int fd, const char *name)
+{
+    struct kernelCtx_t ctx = { name, 0 };
+    struct stat st;
+    char *data = NULL, *tmp;
+    size_t size = 0, alloc = 0, n;
+    int mapped = 0, rc;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        data = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            mapped = 1;
+            size = st.st_size;
+        } else {
+            data = NULL;
+        }
+    }
 
-    if (pfile == NULL) {
-        log_err("... skip, fail to decompile dtb\n");
-    } else {
-        /* Find the type of version */
-        while ((llen = getline(&line, &line_size, pfile)) != -1) {
-            if ((pos = strstr(line,QCDT_BOARD_TAG)) != NULL) {
-                v = 2;
-            }
-            if ((pos = strstr(line,QCDT_PMIC_TAG)) != NULL) {
-                v = 3;
-                break;
+    while (!mapped) {
+        if (alloc - size < COPY_BUF_SIZE) {
+            alloc = alloc ? alloc * 2 : 4 * COPY_BUF_SIZE;
+            tmp = (char *)realloc(data, alloc);
+            if (!tmp) {
+                log_err("Out of memory\n");
+                free(data);
+                return RC_ERROR;
             }
+            data = tmp;
         }
+        n = stream_read(fd, data + size, alloc - size);
+        size += n;
+        if (size < alloc)
+            break;
     }
 
-    free(line);
-    log_info("Version:%d\n", v);
+    rc = fdt_extract((const unsigned char *)data, size, kernel_add, &ctx);
+    if (rc)
+        log_err("Failed to read DTBs from '%s'\n", name);
 
-    return v;
+    if (mapped)
+        munmap(data, size);
+    else
+        free(data);
+    return rc ? RC_ERROR : RC_SUCCESS;
 }
 
-static int find_dtb(const char *path, uint32_t *version)
+/* Queue all DTBs of a stream ('-' for stdin) in the given input format */
+static int read_stream(const char *path)
 {
-    struct dirent *dp;
-    int flen;
-    char *filename;
-    struct chipInfo_t *chip, *t_chip;
-    struct stat st;
-    int num;
-    int rc = RC_SUCCESS;
-    uint32_t msmversion = 0;
-    int dtb_count = 0;
+    const char *name = strcmp(path, "-") ? path : "stdin";
+    char *buf;
+    int fd, rc;
 
-    DIR *dir = opendir(path);
-    if (!dir) {
-        log_err("Failed to open input directory '%s'\n", path);
+    fd = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+    if (fd < 0) {
+        log_err("Failed to open input file '%s'\n", path);
         return RC_ERROR;
     }
 
-    /* Open the .dtb files in the specified path, decompile and
-       extract "qcom,msm-id" parameter
-     */
-    while ((dp = readdir(dir)) != NULL) {
-        if (dp->d_type == DT_UNKNOWN) {
-            struct stat statbuf;
-            char name[PATH_MAX];
-            snprintf(name, sizeof(name), "%s%s%s",
-                     path,
-                     (path[strlen(path) - 1] == '/' ? "" : "/"),
-                     dp->d_name);
-            if (!stat(name, &statbuf)) {
-                if (S_ISREG(statbuf.st_mode)) {
-                    dp->d_type = DT_REG;
-                } else if (S_ISDIR(statbuf.st_mode)) {
-                    dp->d_type = DT_DIR;
-                }
-            }
+    if (input_format == INPUT_LIST) {
+        rc = read_list_stream(fd);
+    } else if (input_format == INPUT_KERNEL) {
+        rc = read_kernel_stream(fd, name);
+    } else {
+        buf = (char *)malloc(COPY_BUF_SIZE);
+        if (!buf || (spool_fd < 0 && spool_open() != RC_SUCCESS)) {
+            rc = RC_ERROR;
+        } else if (input_format == INPUT_TAR) {
+            rc = read_tar_stream(fd, name, buf);
+        } else {
+            rc = read_fdt_stream(fd, name, buf);
         }
+        free(buf);
+    }
 
-        if (dp->d_type == DT_DIR) {
-            char name[PATH_MAX];
-            if (dp->d_name[0] == '.') {
-                continue;
-            }
-            snprintf(name, sizeof(name), "%s%s%s%s",
-                     path,
-                     (path[strlen(path) - 1] == '/' ? "" : "/"),
-                     dp->d_name,
-                     "/");
-            log_info("Searching subdir: %s ... \n", name);
-            dtb_count += find_dtb(name, version);
-        } else if (dp->d_type == DT_REG) {
-            flen = strlen(dp->d_name);
-            if ((flen > 4) &&
-                (strncmp(&dp->d_name[flen-4], ".dtb", 4) == 0)) {
-                log_info("Found file: %s ... \n", dp->d_name);
+    if (fd != STDIN_FILENO)
+        close(fd);
+    return rc;
+}
 
-                flen = strlen(path) + strlen(dp->d_name) + 1;
-                filename = (char *)malloc(flen);
-                if (!filename) {
-                    log_err("Out of memory\n");
-                    rc = RC_ERROR;
-                    break;
-                }
-                strncpy(filename, path, flen);
-                strncat(filename, dp->d_name, flen);
+/* Find and classify all DTBs below path, serially or with --jobs workers */
+static int scan_dtbs(const char *path, uint32_t *version)
+{
+    pthread_t *threads = NULL;
+    struct dtbJob_t *job, *merge;
+    int dtb_count = 0, cached = 0;
+    int i, rc, nthreads = 0;
+    double start = time_now();
 
-                /* To identify the version number */
-                msmversion = GetVersionInfo(filename);
-                if (*version < msmversion) {
-                    *version = msmversion;
-                }
+    if (cache_file)
+        cache_load();
 
-                num = 1;
-                chip = getChipInfo(filename, &num, msmversion);
+    job_pending = job_alloc();
+    if (!job_pending) {
+        log_err("Out of memory\n");
+        return RC_ERROR;
+    }
+    log_file = job_pending->log_file;
 
-                if (msmversion == 1) {
-                    if (!chip) {
-                        log_err("skip, failed to scan for '%s' tag\n", dt_tag);
-                        free(filename);
-                        continue;
-                    }
-                }
-                if (msmversion == 2) {
-                    if (!chip) {
-                        log_err("skip, failed to scan for '%s' or '%s' tag\n",
-                                dt_tag, QCDT_BOARD_TAG);
-                        free(filename);
-                        continue;
-                    }
-                }
-                if (msmversion == 3) {
-                    if (!chip) {
-                        log_err("skip, failed to scan for '%s', '%s' or '%s' tag\n",
-                                dt_tag, QCDT_BOARD_TAG, QCDT_PMIC_TAG);
-                        free(filename);
-                        continue;
-                    }
-                }
+    if (num_jobs > 1) {
+        threads = (pthread_t *)calloc(num_jobs, sizeof(pthread_t));
+        for (i = 0; threads && i < num_jobs; i++) {
+            if (pthread_create(&threads[i], NULL, job_worker, NULL) != 0)
+                break;
+            nthreads++;
+        }
+    }
 
-                if ((stat(filename, &st) != 0) ||
-                    (st.st_size == 0)) {
-                    log_err("skip, failed to get DTB size\n");
-                    free(filename);
-                    continue;
-                }
+    if (input_format == INPUT_DIR)
+        rc = find_dtb(path, version);
+    else
+        rc = read_stream(path);
+
+    pthread_mutex_lock(&job_lock);
+    job_finished = 1;
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+
+    /* without any worker, classify here */
+    if (num_jobs > 1 && nthreads == 0)
+        job_worker(NULL);
+
+    /* collect all entries and sort them once */
+    for (job = job_head; job; job = job->next) {
+        pthread_mutex_lock(&job_lock);
+        while (!job->done)
+            pthread_cond_wait(&job_cond, &job_lock);
+        pthread_mutex_unlock(&job_lock);
+        job_flush_log(job);
+
+        if (job->rc == RC_SUCCESS && job->info.chip &&
+            chip_collect(job->info.chip) != RC_SUCCESS) {
+            chip_free_list(job->info.chip);
+            job->rc = RC_ERROR;
+        }
+        if (!job->rewritten)
+            time_files++;
+    }
 
-                log_info("chipset: %u, rev: %u, platform: %u, subtype: %u, pmic0: %u, pmic1: %u, pmic2: %u, pmic3: %u\n",
-                         chip->chipset, chip->revNum, chip->platform, chip->subtype,
-                         chip->pmic_model[0], chip->pmic_model[1], chip->pmic_model[2], chip->pmic_model[3]);
+    /* log of the discovery after the last DTB */
+    log_file = NULL;
+    if (job_pending) {
+        job_flush_log(job_pending);
+        free(job_pending);
+        job_pending = NULL;
+    }
+    time_scan = time_now() - start - time_log;
 
-                for (t_chip = chip->t_next; t_chip; t_chip = t_chip->t_next) {
-                    log_info("additional chipset: %u, rev: %u, platform: %u, subtype: %u, pmic0: %u, pmic1: %u, pmic2: %u, pmic3: %u\n",
-                             t_chip->chipset, t_chip->revNum, t_chip->platform, t_chip->subtype,
-                             t_chip->pmic_model[0], t_chip->pmic_model[1], t_chip->pmic_model[2], t_chip->pmic_model[3]);
-                }
+    if (cache_file) {
+        cache_save(job_head);
+        cache_free();
+    }
 
-                rc = chip_add(chip);
-                if (rc != RC_SUCCESS) {
-                    log_err("... duplicate info, skipped\n");
-                    free(filename);
-                    continue;
-                }
+    /* buffer the add_dtb() lines, so time_add is the merge alone */
+    merge = job_alloc();
+    if (merge)
+        log_file = merge->log_file;
 
-                dtb_count++;
+    start = time_now();
+    if (chip_group() != RC_SUCCESS) {
+        for (job = job_head; job; job = job->next)
+            job->rc = RC_ERROR;
+    }
 
-                chip->dtb_size = st.st_size +
-                                   (page_size - (st.st_size % page_size));
-                chip->dtb_file = filename;
+    /* merge in discovery order */
+    while ((job = job_head) != NULL) {
+        cached += job->cached;
+        free(job->cache);
+        if (job->rc == RC_SUCCESS) {
+            dtb_count += add_dtb(job, version);
+        } else {
+            free(job->filename);
+            free(job->data);
+        }
 
-                for (t_chip = chip->t_next; t_chip; t_chip = t_chip->t_next) {
-                    rc = chip_add(t_chip);
-                    if (rc != RC_SUCCESS) {
-                        log_err("... duplicate info, skipped (chipset %u, rev: %u, platform: %u, subtype: %u\n",
-                             t_chip->chipset, t_chip->revNum, t_chip->platform, t_chip->subtype);
-                        continue;
-                    }
-                    dtb_count++;
-                }
-            }
+        job_head = job->next;
+        free(job);
+    }
+    job_tail = NULL;
+
+    chip_finish();
+    time_add = time_now() - start;
+
+    log_file = NULL;
+    if (merge) {
+        job_flush_log(merge);
+        free(merge);
+    }
+
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    if (cache_file)
+        log_info("=> Reused %d cached DTB(s)\n", cached);
+
+    return rc < 0 ? RC_ERROR : dtb_count;
+}
+
+/* Store a little endian u32 and advance past it */
+static uint8_t *put_u32(uint8_t *p, uint32_t val)
+{
+    val = htole32(val);
+    memcpy(p, &val, sizeof(val));
+    return p + sizeof(val);
+}
+
+/*
+  Copy size bytes of a DTB from its current position into the output.
+  Try an in-kernel copy first, then sendfile() and finally plain
+  read()/write() with a large buffer.
+  Returns the number of bytes copied, or -1 on error.
+ */
+static ssize_t copy_dtb(int out_fd, int in_fd, size_t size)
+{
+    size_t copied = 0;
+    ssize_t n;
+    char *buf;
+
+    while (copied < size) {
+        n = copy_file_range(in_fd, NULL, out_fd, NULL, size - copied, 0);
+        if (n <= 0)
+            break;
+        copied += n;
+    }
+
+    while (copied < size) {
+        n = sendfile(out_fd, in_fd, NULL, size - copied);
+        if (n <= 0)
+            break;
+        copied += n;
+    }
+
+    if (copied >= size)
+        return copied;
+
+    buf = (char *)malloc(COPY_BUF_SIZE);
+    if (!buf)
+        return -1;
+
+    while (copied < size) {
+        n = read(in_fd, buf, size - copied < COPY_BUF_SIZE ?
+                             size - copied : COPY_BUF_SIZE);
+        if (n <= 0)
+            break;
+        if (write(out_fd, buf, n) != n) {
+            free(buf);
+            return -1;
         }
+        copied += n;
     }
-    closedir(dir);
-    return dtb_count;
+    free(buf);
+
+    return n < 0 ? -1 : (ssize_t)copied;
+}
+
+/* Write a DTB held in memory, returns its size or -1 on error */
+static ssize_t write_dtb(int out_fd, const void *data, size_t size)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < size) {
+        n = write(out_fd, (const char *)data + off, size - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        off += n;
+    }
+    return off;
+}
+
+/*
+  Skip over padding, leaving a hole which reads back as zeroes.  Only
+  done for a sparse output, i.e. a regular file we truncated ourselves,
+  anything else (stdout, O_APPEND, block devices) gets the zeroes written.
+ */
+static ssize_t pad_output(int out_fd, const uint8_t *filler, size_t padding,
+                          int sparse)
+{
+    if (sparse && lseek(out_fd, padding, SEEK_CUR) >= 0)
+        return padding;
+
+    return write(out_fd, filler, padding);
 }
 
 /* Extract 'qcom,msm-id' 'qcom,board-id' parameter from DTB
@@ -921,14 +2880,14 @@ static int find_dtb(const char *path, uint32_t *version)
  */
 int main(int argc, char **argv)
 {
-    char buf[COPY_BLK];
     struct chipInfo_t *chip;
-    FILE *pInputFile;
+    struct stat st;
     int padding;
     uint8_t *filler = NULL;
-    int numBytesRead = 0;
-    int totBytesRead = 0;
-    int out_fd;
+    uint8_t *table = NULL, *p;
+    ssize_t copied;
+    int in_fd, out_fd;
+    int sparse = 0;
     int rc = RC_SUCCESS;
     int dtb_count = 0, dtb_offset = 0, entry_size;
     size_t wrote = 0, expected = 0;
@@ -944,7 +2903,13 @@ int main(int argc, char **argv)
         return RC_ERROR;
     }
 
-    log_info("  Input directory: '%s'\n", input_dir);
+    if (efidroid_parser)
+        libboot_init();
+
+    if (input_format == INPUT_DIR)
+        log_info("  Input directory: '%s'\n", input_dir);
+    else
+        log_info("  Input file: '%s'\n", input_dir);
     log_info("  Output file: '%s'\n", output_file);
 
 
@@ -955,7 +2920,11 @@ int main(int argc, char **argv)
     }
     memset(filler, 0, page_size);
 
-    dtb_count = find_dtb(input_dir, &version);
+    dtb_count = scan_dtbs(input_dir, &version);
+    if (dtb_count < 0) {
+        rc = RC_ERROR;
+        goto cleanup;
+    }
 
     log_info("=> Found %d unique DTB(s)\n", dtb_count);
 
@@ -971,13 +2940,22 @@ int main(int argc, char **argv)
 
     log_info("\nGenerating master DTB... ");
 
-    out_fd = open(output_file, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    time_write = time_now();
+    if (!strcmp(output_file, "-"))
+        out_fd = STDOUT_FILENO;
+    else
+        out_fd = open(output_file, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
     if (out_fd == -1) {
         log_err("Cannot create '%s'\n", output_file);
         rc = RC_ERROR;
         goto cleanup;
     }
 
+    /* holes and ftruncate() only for a file we created from offset 0 */
+    if (out_fd != STDOUT_FILENO && fstat(out_fd, &st) == 0 &&
+        S_ISREG(st.st_mode))
+        sparse = 1;
+
     if (version_override != 0) {
         version = version_override;
     }
@@ -995,12 +2973,6 @@ int main(int argc, char **argv)
     if (motorola_version)
         entry_size += 32;
 
-    /* Write header info */
-    wrote += write(out_fd, QCDT_MAGIC, sizeof(uint8_t) * 4); /* magic */
-    wrote += write(out_fd, &hdr_version, sizeof(uint32_t));      /* version */
-    wrote += write(out_fd, (uint32_t *)&dtb_count, sizeof(uint32_t));
-                                                             /* #DTB */
-
     /* Calculate offset of first DTB block */
     dtb_offset = 12                       + /* header */
                  (entry_size * dtb_count) + /* DTB table entries */
@@ -1011,6 +2983,22 @@ int main(int argc, char **argv)
     dtb_offset += padding;
     expected = dtb_offset;
 
+    /* Header, table and padding are built in memory and written at once */
+    table = (uint8_t *)calloc(1, dtb_offset);
+    if (!table) {
+        log_err("Out of memory\n");
+        close(out_fd);
+        if (strcmp(output_file, "-"))
+            unlink(output_file);
+        rc = RC_ERROR;
+        goto cleanup;
+    }
+
+    /* Header info */
+    memcpy(table, QCDT_MAGIC, sizeof(uint8_t) * 4);   /* magic */
+    p = put_u32(table + 4, hdr_version);              /* version */
+    p = put_u32(p, dtb_count);                        /* #DTB */
+
     /* Write index table:
          chipset
          platform
@@ -1024,34 +3012,33 @@ int main(int argc, char **argv)
          dtb size
      */
     for (chip = chip_list; chip; chip = chip->next) {
-        wrote += write(out_fd, &chip->chipset, sizeof(uint32_t));
-        wrote += write(out_fd, &chip->platform, sizeof(uint32_t));
+        p = put_u32(p, chip->chipset);
+        p = put_u32(p, chip->platform);
         if (version >= 2) {
-            wrote += write(out_fd, &chip->subtype, sizeof(uint32_t));
+            p = put_u32(p, chip->subtype);
         }
-        wrote += write(out_fd, &chip->revNum, sizeof(uint32_t));
+        p = put_u32(p, chip->revNum);
         if (version >= 3) {
-            wrote += write(out_fd, &chip->pmic_model[0], sizeof(uint32_t));
-            wrote += write(out_fd, &chip->pmic_model[1], sizeof(uint32_t));
-            wrote += write(out_fd, &chip->pmic_model[2], sizeof(uint32_t));
-            wrote += write(out_fd, &chip->pmic_model[3], sizeof(uint32_t));
+            p = put_u32(p, chip->pmic_model[0]);
+            p = put_u32(p, chip->pmic_model[1]);
+            p = put_u32(p, chip->pmic_model[2]);
+            p = put_u32(p, chip->pmic_model[3]);
         }
-        if (chip->master->master_offset != 0) {
-            wrote += write(out_fd, &chip->master->master_offset, sizeof(uint32_t));
-        } else {
-            wrote += write(out_fd, &expected, sizeof(uint32_t));
+        if (chip->master->master_offset == 0) {
             chip->master->master_offset = expected;
             expected += chip->master->dtb_size;
         }
-        wrote += write(out_fd, &chip->master->dtb_size, sizeof(uint32_t));
-        if (motorola_version)
-            wrote += write(out_fd, &chip->model, sizeof(chip->model));
+        p = put_u32(p, chip->master->master_offset);
+        p = put_u32(p, chip->master->dtb_size);
+        if (motorola_version) {
+            memcpy(p, chip->model, sizeof(chip->model));
+            p += sizeof(chip->model);
+        }
     }
 
+    /* end of table indicator and padding are already zero */
     rc = RC_SUCCESS;
-    wrote += write(out_fd, &rc, sizeof(uint32_t)); /* end of table indicator */
-    if (padding > 0)
-        wrote += write(out_fd, filler, padding);
+    wrote += write(out_fd, table, dtb_offset);
 
     /* Write DTB's */
     for (chip = chip_list; chip; chip = chip->next) {
@@ -1064,31 +3051,50 @@ int main(int argc, char **argv)
         dtb_size = chip->master->dtb_size;
 
         log_dbg("\n (writing '%s' - %u bytes) ", filename, dtb_size);
-        pInputFile = fopen(filename, "r");
-        if (pInputFile != NULL) {
-            totBytesRead = 0;
-            while ((numBytesRead = fread(buf, 1, COPY_BLK, pInputFile)) > 0) {
-                wrote += write(out_fd, buf, numBytesRead);
-                totBytesRead += numBytesRead;
-            }
-            fclose(pInputFile);
-            padding = page_size - (totBytesRead % page_size);
-            if ((uint32_t)(totBytesRead + padding) != dtb_size) {
-                log_err("DTB size mismatch, please re-run: expected %d vs actual %d (%s)\n",
-                        dtb_size, totBytesRead + padding,
-                        filename);
+        copied = -1;
+        if (chip->master->dtb_data) {
+            copied = write_dtb(out_fd, chip->master->dtb_data,
+                               chip->master->dtb_spool_size);
+        } else if (chip->master->dtb_spooled) {
+            if (lseek(spool_fd, chip->master->dtb_spool_offset, SEEK_SET) >= 0)
+                copied = copy_dtb(out_fd, spool_fd,
+                                  chip->master->dtb_spool_size);
+        } else {
+            in_fd = open(filename, O_RDONLY);
+            if (in_fd < 0) {
+                log_err("failed to open DTB '%s'\n", filename);
                 rc = RC_ERROR;
                 break;
             }
-            if (padding > 0)
-                wrote += write(out_fd, filler, padding);
-        } else {
-            log_err("failed to open DTB '%s'\n", filename);
+            if (fstat(in_fd, &st) == 0)
+                copied = copy_dtb(out_fd, in_fd, st.st_size);
+            close(in_fd);
+        }
+        if (copied < 0) {
+            log_err("failed to copy DTB '%s'\n", filename);
+            rc = RC_ERROR;
+            break;
+        }
+        wrote += copied;
+        padding = page_size - (copied % page_size);
+        if ((uint32_t)(copied + padding) != dtb_size) {
+            log_err("DTB size mismatch, please re-run: expected %d vs actual %d (%s)\n",
+                    dtb_size, (int)(copied + padding),
+                    filename);
             rc = RC_ERROR;
             break;
         }
+        if (padding > 0)
+            wrote += pad_output(out_fd, filler, padding, sparse);
+    }
+
+    /* the trailing padding may be a hole, extend the file over it */
+    if (rc == RC_SUCCESS && sparse && ftruncate(out_fd, wrote) != 0) {
+        log_err("failed to extend output file\n");
+        rc = RC_ERROR;
     }
     close(out_fd);
+    time_write = time_now() - time_write;
 
     if (expected != wrote) {
         log_err("error writing output file, please rerun: size mismatch %zu vs %zu\n",
@@ -1097,13 +3103,31 @@ int main(int argc, char **argv)
     } else
         log_dbg("Total wrote %zu bytes\n", wrote);
 
-    if (rc != RC_SUCCESS)
-        unlink(output_file);
-    else
+    if (rc != RC_SUCCESS) {
+        if (strcmp(output_file, "-"))
+            unlink(output_file);
+    } else {
         log_info("completed\n");
+        if (timing) {
+            log_info("=> find_dtb: %d DTB(s) in %.3f s (%.0f DTB/s)\n",
+                     time_files, time_scan,
+                     time_scan > 0 ? time_files / time_scan : 0);
+            log_info("=> chip_add: %d entries in %.3f s (%.0f entries/s)\n",
+                     dtb_count, time_add,
+                     time_add > 0 ? dtb_count / time_add : 0);
+            log_info("=> write: %zu bytes in %.3f s (%.1f MiB/s)\n",
+                     wrote, time_write,
+                     time_write > 0 ? wrote / time_write / (1024 * 1024) : 0);
+            log_info("=> log: %zu bytes in %.3f s\n", log_bytes, time_log);
+        }
+    }
 
 cleanup:
+    if (spool_fd >= 0)
+        close(spool_fd);
+    free(table);
     free(filler);
+    free(dt_prop);
     chip_deleteall();
     return rc;
 }
@@ -0,0 +1,523 @@
+/* Copyright (c) 2012-2014, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * * Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <libfdt.h>
+
+#include <list.h>
+#include <lib/boot.h>
+#include <lib/boot/qcdt.h>
+
+#include <efidroidify.h>
+
+#define DTB_PAD_SIZE  1024
+#define ROUNDUP(a, b) (((a) + ((b)-1)) & ~((b)-1))
+
+#define MAX_LEVEL   32      /* how deeply nested we will go */
+static int list_subnodes_callback(void *blob, const char *parentpath, int (*callback)(void *fdt, const char *path, void *pdata), void *pdata)
+{
+    int nextoffset;     /* next node offset from libfdt */
+    uint32_t tag;       /* current tag */
+    int level = 0;      /* keep track of nesting level */
+    const char *pathp;
+    int depth = 1;      /* the assumed depth of this node */
+    const char *newpath = NULL;
+
+    // get offset
+    int node = fdt_path_offset(blob, parentpath);
+    if (node < 0) {
+        return 1;
+    }
+
+    if (!strcmp(parentpath, "/"))
+        parentpath++;
+
+    while (level >= 0) {
+        tag = fdt_next_tag(blob, node, &nextoffset);
+        switch (tag) {
+            case FDT_BEGIN_NODE:
+                pathp = fdt_get_name(blob, node, NULL);
+                if (level <= depth) {
+                    if (pathp == NULL)
+                        pathp = "/* NULL pointer error */";
+                    if (*pathp == '\0')
+                        pathp = "/";    /* root is nameless */
+
+                    if (level == 1) {
+                        newpath = pathp;
+                    }
+                }
+                level++;
+                if (level >= MAX_LEVEL) {
+                    printf("Nested too deep, aborting.\n");
+                    return 1;
+                }
+                break;
+            case FDT_END_NODE:
+                level--;
+                if (level == 0)
+                    level = -1;     /* exit the loop */
+
+                if (newpath && level==1) {
+                    // allocate name
+                    size_t nodepath_len = strlen(parentpath)+1+strlen(newpath)+1;
+                    char *nodepath = malloc(nodepath_len);
+                    if (!nodepath) return 1;
+
+                    // build name
+                    int rc = snprintf(nodepath, nodepath_len, "%s/%s", parentpath, newpath);
+                    if (rc<0 || (size_t)rc>=nodepath_len)
+                        return 1;
+
+                    // callback
+                    if (callback(blob, nodepath, pdata))
+                        return 1;
+
+                    // list subnodes
+                    if (list_subnodes_callback(blob, nodepath, callback, pdata))
+                        return 1;
+
+                    // cleanup
+                    free(nodepath);
+
+                    newpath = NULL;
+                }
+
+                break;
+            case FDT_END:
+                return 1;
+            case FDT_PROP:
+                break;
+            case FDT_NOP:
+                break;
+            default:
+                if (level <= depth)
+                    printf("Unknown tag 0x%08X\n", tag);
+                return 1;
+        }
+        node = nextoffset;
+    }
+    return 0;
+}
+
+static int startswith(const char *str, const char *pre)
+{
+    return strncmp(pre, str, strlen(pre)) == 0;
+}
+
+static const char *whitelist[] = {
+    "/aliases",
+    "/chosen",
+    "/memory",
+    "/cpus",
+    "/soc/qcom,mdss_mdp",
+    "/soc/qcom,mdss_dsi",
+    NULL,
+};
+
+// what callback_fn() removes the nodes from and where it reports errors
+typedef struct {
+    void *fdtcopy;
+    FILE *err;
+} remove_ctx_t;
+
+static int callback_fn(void *fdt, const char *path, void *pdata)
+{
+    remove_ctx_t *rm = (remove_ctx_t *)pdata;
+    void *fdtcopy = rm->fdtcopy;
+    FILE *err = rm->err;
+
+    (void)(fdt);
+
+    // get offset
+    int offset = fdt_path_offset(fdtcopy, path);
+    if (offset < 0) {
+        // ignore this because it can happen when you remove nodes
+        if (offset==-FDT_ERR_NOTFOUND)
+            return 0;
+
+        fprintf(err, "can't find node %s: %s\n", path, fdt_strerror(offset));
+        return 1;
+    }
+
+    // scan whitelist
+    int is_whitelisted = 0;
+    const char **ptr = whitelist;
+    while (*ptr) {
+        // prefix is whitelisted
+        if (startswith(path, *ptr)) {
+            is_whitelisted = 1;
+            break;
+        }
+
+        // this is the parent of a whitelisted item
+        if (startswith(*ptr, path)) {
+            is_whitelisted = 1;
+            break;
+        }
+
+        ptr++;
+    }
+
+    // keep
+    if (is_whitelisted)
+        return 0;
+
+    // remove
+    int rc = fdt_del_node(fdtcopy, offset);
+    if (rc < 0) {
+        fprintf(err, "can't remove node %s: %s\n", path, fdt_strerror(rc));
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Delete a node in the fdt.
+ *
+ * @param blob      FDT blob to write into
+ * @param node_name Name of node to delete
+ * @param err       Stream for error messages
+ * @return 0 on success, or -1 on failure
+ */
+static int delete_node(char *blob, const char *node_name, FILE *err)
+{
+    int node = 0;
+
+    node = fdt_path_offset(blob, node_name);
+    if (node < 0) {
+        fprintf(err, "can't find %s: %s\n", node_name, fdt_strerror(node));
+        return -1;
+    }
+
+    node = fdt_del_node(blob, node);
+    if (node < 0) {
+        fprintf(err, "can't delete %s: %s\n", node_name, fdt_strerror(node));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void generate_entries_add_cb(dt_entry_local_t *dt_entry, dt_entry_node_t *dt_list, const char *model)
+{
+    (void)(model);
+
+    dt_entry_node_t *dt_node = dt_entry_list_alloc_node();
+    memcpy(dt_node->dt_entry_m, dt_entry, sizeof(dt_entry_local_t));
+    dt_entry_list_insert(dt_list, dt_node);
+}
+
+// free a list from dt_entry_list_create() with all of its entries
+static void dt_entry_list_free_all(dt_entry_node_t *dt_list)
+{
+    dt_entry_node_t *dt_node, *tmp;
+
+    libboot_list_for_every_entry_safe(&dt_list->node, dt_node, tmp, dt_entry_node_t, node) {
+        dt_entry_list_delete(dt_node);
+    }
+    libboot_free(dt_list);
+}
+
+int efidroidify_dtb(const void *fdt, size_t size, int remove_unused_nodes, const char *parser,
+                    FILE *log, FILE *err, efidroidify_cb_t callback, void *ctx)
+{
+    int rc;
+    void *fdtcopy = NULL;
+    int offset_root;
+    dt_entry_node_t *dt_list = NULL;
+
+    /* Initialize the dtb entry node*/
+    dt_list = dt_entry_list_create();
+    if (!dt_list) {
+        fprintf(err, "Can't allocate dt list\n");
+        return -ENOMEM;
+    }
+
+    // check header
+    if (size < sizeof(struct fdt_header) || fdt_check_header(fdt) || fdt_totalsize(fdt) > size) {
+        fprintf(err, "Invalid fdt header\n");
+        rc = -1;
+        goto cleanup;
+    }
+
+    // get chipinfo
+    rc = libboot_qcdt_generate_entries((void *)fdt, fdt_totalsize(fdt), dt_list, generate_entries_add_cb, parser);
+    if (rc!=1) {
+        fprintf(err, "can't get chipinfo: %d\n", rc);
+        rc = -1;
+        goto cleanup;
+    }
+
+    // allocate fdcopy
+    size_t fdtcopysz = ROUNDUP(size + DTB_PAD_SIZE, sizeof(uint32_t));
+    fdtcopy = malloc(fdtcopysz);
+    if (!fdtcopy) {
+        fprintf(err, "can't allocate fdtcopy\n");
+        rc = -ENOMEM;
+        goto cleanup;
+    }
+
+    // copy fdt
+    rc = fdt_open_into(fdt, fdtcopy, fdtcopysz);
+    if (rc<0) {
+        fprintf(err, "can't copy fdt %s\n", fdt_strerror(rc));
+        goto cleanup;
+    }
+
+    // remove unneeded nodes
+    if (remove_unused_nodes) {
+        remove_ctx_t rm = { fdtcopy, err };
+        list_subnodes_callback((void *)fdt, "/", callback_fn, &rm);
+    }
+
+    // recreate /chosen node to remove all it's contents
+    delete_node(fdtcopy, "/chosen", err);
+    fdt_add_subnode(fdtcopy, fdt_path_offset(fdtcopy, "/"), "chosen");
+
+    // rewrite it for every entry
+    dt_entry_node_t *dt_node = NULL;
+    dt_entry_data_t *dt_entry = NULL;
+    libboot_list_for_every_entry(&dt_list->node, dt_node, dt_entry_node_t, node) {
+        dt_entry = &dt_node->dt_entry_m->data;
+        const char *parser_name = dt_node->dt_entry_m->parser;
+
+        if (log) {
+            fprintf(log, "chipset: %u, rev: %u, platform: %u, subtype: %u, pmic0: %u, pmic1: %u, pmic2: %u, pmic3: %u",
+                    dt_entry->platform_id, dt_entry->soc_rev, dt_entry->variant_id, dt_entry->board_hw_subtype,
+                    dt_entry->pmic_rev[0], dt_entry->pmic_rev[1], dt_entry->pmic_rev[2], dt_entry->pmic_rev[3]);
+
+            if (!strcmp(parser_name, "qcom_lge")) {
+                fprintf(log, ", lgerev: %x", dt_entry->u.lge.lge_rev);
+            }
+
+            if (!strcmp(parser_name, "qcom_oppo")) {
+                fprintf(log, ", oppoid: %x/%x", dt_entry->u.oppo.id0, dt_entry->u.oppo.id1);
+            }
+
+            if (!strcmp(parser_name, "qcom_motorola")) {
+                fprintf(log, ", mmiversion: %d, mmimodel: %s", dt_entry->u.motorola.version, dt_entry->u.motorola.model);
+            }
+
+            fprintf(log, "\n");
+        }
+
+        // patch msm-id
+        if (dt_entry->version==1) {
+            // get root
+            offset_root = fdt_path_offset(fdtcopy, "/");
+            if (offset_root<0) {
+                fprintf(err, "Can't get root node %s\n", fdt_strerror(offset_root));
+                rc = -1;
+                goto cleanup;
+            }
+
+            rc = fdt_setprop_u32(fdtcopy, offset_root, "qcom,msm-id", dt_entry->platform_id);
+            if (rc < 0) {
+                fprintf(err, "Can't set property %s\n", fdt_strerror(offset_root));
+                rc = -1;
+                goto cleanup;
+            }
+
+            rc = fdt_appendprop_u32(fdtcopy, offset_root, "qcom,msm-id", dt_entry->variant_id);
+            if (rc < 0) {
+                fprintf(err, "Can't append property %s\n", fdt_strerror(offset_root));
+                rc = -1;
+                goto cleanup;
+            }
+
+            rc = fdt_appendprop_u32(fdtcopy, offset_root, "qcom,msm-id", dt_entry->soc_rev);
+            if (rc < 0) {
+                fprintf(err, "Can't append property %s\n", fdt_strerror(offset_root));
+                rc = -1;
+                goto cleanup;
+            }
+
+            if (!strcmp(parser_name, "qcom_lge")) {
+                rc = fdt_appendprop_u32(fdtcopy, offset_root, "qcom,msm-id", dt_entry->u.lge.lge_rev);
+                if (rc < 0) {
+                    fprintf(err, "Can't append property %s\n", fdt_strerror(offset_root));
+                    rc = -1;
+                    goto cleanup;
+                }
+            }
+        } else if (dt_entry->version==2 || dt_entry->version==3) {
+            // get root
+            offset_root = fdt_path_offset(fdtcopy, "/");
+            if (offset_root<0) {
+                fprintf(err, "Can't get root node %s\n", fdt_strerror(offset_root));
+                rc = -1;
+                goto cleanup;
+            }
+
+            rc = fdt_setprop_u32(fdtcopy, offset_root, "qcom,msm-id", dt_entry->platform_id);
+            if (rc < 0) {
+                fprintf(err, "Can't set property %s\n", fdt_strerror(offset_root));
+                rc = -1;
+                goto cleanup;
+            }
+
+            rc = fdt_appendprop_u32(fdtcopy, offset_root, "qcom,msm-id", dt_entry->soc_rev);
+            if (rc < 0) {
+                fprintf(err, "Can't append property %s\n", fdt_strerror(offset_root));
+                rc = -1;
+                goto cleanup;
+            }
+        }
+
+        // patch board-id
+        if (dt_entry->version==2 || dt_entry->version==3) {
+            // get root
+            offset_root = fdt_path_offset(fdtcopy, "/");
+            if (offset_root<0) {
+                fprintf(err, "Can't get root node %s\n", fdt_strerror(offset_root));
+                rc = -1;
+                goto cleanup;
+            }
+
+            rc = fdt_setprop_u32(fdtcopy, offset_root, "qcom,board-id", dt_entry->variant_id);
+            if (rc < 0) {
+                fprintf(err, "Can't set property %s\n", fdt_strerror(offset_root));
+                rc = -1;
+                goto cleanup;
+            }
+
+            rc = fdt_appendprop_u32(fdtcopy, offset_root, "qcom,board-id", dt_entry->board_hw_subtype);
+            if (rc < 0) {
+                fprintf(err, "Can't append property %s\n", fdt_strerror(offset_root));
+                rc = -1;
+                goto cleanup;
+            }
+
+            if (!strcmp(parser_name, "qcom_oppo")) {
+                rc = fdt_appendprop_u32(fdtcopy, offset_root, "qcom,board-id", dt_entry->u.oppo.id0);
+                if (rc < 0) {
+                    fprintf(err, "Can't append property %s\n", fdt_strerror(offset_root));
+                    rc = -1;
+                    goto cleanup;
+                }
+
+                rc = fdt_appendprop_u32(fdtcopy, offset_root, "qcom,board-id", dt_entry->u.oppo.id1);
+                if (rc < 0) {
+                    fprintf(err, "Can't append property %s\n", fdt_strerror(offset_root));
+                    rc = -1;
+                    goto cleanup;
+                }
+            }
+        }
+
+        // patch pmic-id
+        if (dt_entry->version==3) {
+            // get root
+            offset_root = fdt_path_offset(fdtcopy, "/");
+            if (offset_root<0) {
+                fprintf(err, "Can't get root node %s\n", fdt_strerror(offset_root));
+                rc = -1;
+                goto cleanup;
+            }
+
+            rc = fdt_setprop_u32(fdtcopy, offset_root, "qcom,pmic-id", dt_entry->pmic_rev[0]);
+            if (rc < 0) {
+                fprintf(err, "Can't set property %s\n", fdt_strerror(offset_root));
+                rc = -1;
+                goto cleanup;
+            }
+
+            rc = fdt_appendprop_u32(fdtcopy, offset_root, "qcom,pmic-id", dt_entry->pmic_rev[1]);
+            if (rc < 0) {
+                fprintf(err, "Can't append property %s\n", fdt_strerror(offset_root));
+                rc = -1;
+                goto cleanup;
+            }
+
+            rc = fdt_appendprop_u32(fdtcopy, offset_root, "qcom,pmic-id", dt_entry->pmic_rev[2]);
+            if (rc < 0) {
+                fprintf(err, "Can't append property %s\n", fdt_strerror(offset_root));
+                rc = -1;
+                goto cleanup;
+            }
+
+            rc = fdt_appendprop_u32(fdtcopy, offset_root, "qcom,pmic-id", dt_entry->pmic_rev[3]);
+            if (rc < 0) {
+                fprintf(err, "Can't append property %s\n", fdt_strerror(offset_root));
+                rc = -1;
+                goto cleanup;
+            }
+        }
+
+        // get root node
+        offset_root = fdt_path_offset(fdtcopy, "/");
+        if (offset_root<0) {
+            fprintf(err, "can't get root offset %s\n", fdt_strerror(rc));
+            rc = offset_root;
+            goto cleanup;
+        }
+
+        // write efidroid soc info
+        rc = fdt_setprop(fdtcopy, offset_root, "efidroid-soc-info", dt_entry, sizeof(*dt_entry));
+        if (rc<0) {
+            fprintf(err, "Can't set efidroid prop %s\n", fdt_strerror(rc));
+            rc = -1;
+            goto cleanup;
+        }
+
+        // write parser name
+        rc = fdt_setprop_string(fdtcopy, offset_root, "efidroid-fdt-parser", parser_name);
+        if (rc<0) {
+            fprintf(err, "Can't set efidroid prop %s\n", fdt_strerror(rc));
+            rc = -1;
+            goto cleanup;
+        }
+
+        // pack fdt
+        fdt_pack(fdtcopy);
+
+        // align fdt size
+        rc = fdt_open_into(fdtcopy, fdtcopy, ROUNDUP(fdt_totalsize(fdtcopy), sizeof(uint32_t)));
+        if (rc<0) {
+            fprintf(err, "can't align fdt size %s\n", fdt_strerror(rc));
+            goto cleanup;
+        }
+
+        rc = callback(ctx, fdtcopy, fdt_totalsize(fdtcopy), dt_node->dt_entry_m);
+        if (rc)
+            goto cleanup;
+    }
+
+    rc = 0;
+
+cleanup:
+    free(fdtcopy);
+    dt_entry_list_free_all(dt_list);
+    return rc;
+}
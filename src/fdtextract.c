@@ -34,11 +34,60 @@
 #include <string.h>
 #include <stdint.h>
 #include <limits.h>
+#include <getopt.h>
+#include <fnmatch.h>
+#include <endian.h>
+#include <sys/mman.h>
 #include <libfdt.h>
 
+#include <fdtscan.h>
+#include <sha256.h>
+
 #define ROUNDUP(a, b) (((a) + ((b)-1)) & ~((b)-1))
 #define ROUNDDOWN(a, b) ((a) & ~((b)-1))
 
+// --pack/--reference output, see pack_finish() for the index layout
+#define PACK_NONE      0
+#define PACK_FILE      1
+#define PACK_REFERENCE 2
+
+#define PACK_PAYLOAD "dtbs.bin"
+#define PACK_INDEX   "dtbs.idx"
+#define PACK_MAGIC   "FDTI"
+#define PACK_VERSION 1
+#define PACK_HEADER_SIZE 32
+#define PACK_RECORD_SIZE (24 + SHA256_DIGEST_SIZE)
+#define PACK_NO_STRING 0xffffffff
+// the DTB is in the input file rather than the payload
+#define PACK_IN_INPUT  0x1
+
+typedef struct {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint32_t compatible;
+    uint32_t model;
+    uint8_t hash[SHA256_DIGEST_SIZE];
+} pack_record_t;
+
+static int pack_mode = PACK_NONE;
+static const char *input_base;      // mapped input, for --reference
+static size_t input_size;
+static int payload_fd = -1;
+static uint64_t payload_size;
+static pack_record_t *pack_records;
+static uint32_t pack_count, pack_cap;
+static char *pack_strings;
+static uint32_t pack_strings_size, pack_strings_cap;
+
+// filters on the root node, a DTB is written if it matches all of them
+static const char *filter_compatible;
+static const char *filter_model;
+static uint32_t filter_msm_id[2];       // chipset, rev
+static int filter_msm_id_cells;         // 0: no filter, 1: chipset only
+static uint32_t filter_board_id[2];     // platform, subtype
+static int filter_board_id_cells;
+
 off_t fdsize(int fd)
 {
     off_t off;
@@ -49,21 +98,508 @@ off_t fdsize(int fd)
     return off;
 }
 
+// read the whole file, short reads are retried
+static ssize_t read_full(int fd, void *buf, size_t size)
+{
+    size_t off = 0;
+    ssize_t ret;
+
+    while (off < size) {
+        ret = read(fd, (char *)buf + off, size - off);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return ret;
+        if (ret == 0)
+            break;
+        off += ret;
+    }
+
+    return off;
+}
+
+static int write_full(int fd, const void *data, size_t size)
+{
+    const char *p = data;
+    ssize_t ret;
+
+    while (size > 0) {
+        ret = write(fd, p, size);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -EIO;
+        p += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+static unsigned char *put_u32(unsigned char *p, uint32_t val)
+{
+    val = htole32(val);
+    memcpy(p, &val, sizeof(val));
+    return p + sizeof(val);
+}
+
+static unsigned char *put_u64(unsigned char *p, uint64_t val)
+{
+    val = htole64(val);
+    memcpy(p, &val, sizeof(val));
+    return p + sizeof(val);
+}
+
+// add str to the string table of the index, returns its offset
+static uint32_t pack_string(const char *str, int len)
+{
+    uint32_t off = pack_strings_size;
+    char *strings;
+
+    if (!str || len <= 0)
+        return PACK_NO_STRING;
+
+    // properties aren't necessarily terminated
+    len = strnlen(str, len);
+    if (pack_strings_cap - pack_strings_size < (uint32_t)len + 1) {
+        pack_strings_cap = (pack_strings_cap + len + 1) * 2;
+        strings = realloc(pack_strings, pack_strings_cap);
+        if (!strings)
+            return PACK_NO_STRING;
+        pack_strings = strings;
+    }
+
+    memcpy(pack_strings + off, str, len);
+    pack_strings[off + len] = '\0';
+    pack_strings_size += len + 1;
+    return off;
+}
+
+// an aligned copy of fdt if it isn't 8 byte aligned already, for libfdt
+static const void *fdt_aligned(const void *fdt, uint32_t fdtsize, void **copy)
+{
+    *copy = NULL;
+    if (!((uintptr_t)fdt & 7))
+        return fdt;
+
+    *copy = malloc(fdtsize);
+    if (!*copy)
+        return NULL;
+    memcpy(*copy, fdt, fdtsize);
+    return *copy;
+}
+
+// does any of tuples of ncells cells start with the ncmp cells of want
+static int match_cells(const fdt32_t *cells, int len, int ncells, const uint32_t *want, int ncmp)
+{
+    int i, j, n = len / (int)sizeof(fdt32_t);
+
+    for (i = 0; i + ncells <= n; i += ncells) {
+        for (j = 0; j < ncmp; j++) {
+            if (fdt32_to_cpu(cells[i + j]) != want[j])
+                break;
+        }
+        if (j == ncmp)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Check the root node against the filters.  'qcom,msm-id' has <chipset rev>
+ * pairs if there's a 'qcom,board-id', else <chipset platform rev> triplets
+ * whose platform stands in for the board-id, like dtbtool reads them.
+ */
+static int fdt_filter(const void *fdt, uint32_t fdtsize)
+{
+    const fdt32_t *msm_id, *board_id;
+    const char *str;
+    const void *afdt;
+    void *copy;
+    int node, len, msm_len, board_len;
+    int match = 0;
+
+    if (!filter_compatible && !filter_model && !filter_msm_id_cells && !filter_board_id_cells)
+        return 1;
+
+    afdt = fdt_aligned(fdt, fdtsize, &copy);
+    if (!afdt)
+        return -ENOMEM;
+
+    node = fdt_path_offset(afdt, "/");
+    if (node < 0)
+        goto out;
+
+    if (filter_compatible) {
+        str = fdt_getprop(afdt, node, "compatible", &len);
+        if (!str)
+            goto out;
+        // any string of the list
+        while (len > 0) {
+            size_t n = strnlen(str, len);
+
+            if (n < (size_t)len && !fnmatch(filter_compatible, str, 0))
+                break;
+            len -= n + 1;
+            str += n + 1;
+        }
+        if (len <= 0)
+            goto out;
+    }
+
+    if (filter_model) {
+        str = fdt_getprop(afdt, node, "model", &len);
+        if (!str || len <= 0 || strnlen(str, len) == (size_t)len || fnmatch(filter_model, str, 0))
+            goto out;
+    }
+
+    msm_id = fdt_getprop(afdt, node, "qcom,msm-id", &msm_len);
+    board_id = fdt_getprop(afdt, node, "qcom,board-id", &board_len);
+
+    if (filter_msm_id_cells) {
+        if (!msm_id)
+            goto out;
+        if (board_id) {
+            if (!match_cells(msm_id, msm_len, 2, filter_msm_id, filter_msm_id_cells))
+                goto out;
+        } else {
+            // v1: chipset and rev are the first and third cell
+            uint32_t i, n = msm_len / sizeof(fdt32_t);
+
+            for (i = 0; i + 3 <= n; i += 3) {
+                if (fdt32_to_cpu(msm_id[i]) == filter_msm_id[0] &&
+                    (filter_msm_id_cells < 2 || fdt32_to_cpu(msm_id[i + 2]) == filter_msm_id[1]))
+                    break;
+            }
+            if (i + 3 > n)
+                goto out;
+        }
+    }
+
+    if (filter_board_id_cells) {
+        if (board_id) {
+            if (!match_cells(board_id, board_len, 2, filter_board_id, filter_board_id_cells))
+                goto out;
+        } else {
+            // v1 DTBs have no subtype
+            uint32_t i, n = msm_id ? msm_len / sizeof(fdt32_t) : 0;
+
+            for (i = 0; i + 3 <= n; i += 3) {
+                if (fdt32_to_cpu(msm_id[i + 1]) == filter_board_id[0] &&
+                    (filter_board_id_cells < 2 || filter_board_id[1] == 0))
+                    break;
+            }
+            if (i + 3 > n)
+                goto out;
+        }
+    }
+
+    match = 1;
+
+out:
+    free(copy);
+    return match;
+}
+
+static int pack_fdt(const void *fdt, uint32_t fdtsize)
+{
+    static const char zeroes[8];
+    pack_record_t *rec;
+    const void *afdt;
+    void *copy;
+    int node, len, rc;
+
+    if (pack_count == pack_cap) {
+        pack_cap = pack_cap ? pack_cap * 2 : 64;
+        rec = realloc(pack_records, pack_cap * sizeof(*rec));
+        if (!rec)
+            return -ENOMEM;
+        pack_records = rec;
+    }
+    rec = &pack_records[pack_count];
+    memset(rec, 0, sizeof(*rec));
+    rec->size = fdtsize;
+
+    if (pack_mode == PACK_REFERENCE && (const char *)fdt >= input_base &&
+        (const char *)fdt < input_base + input_size) {
+        rec->offset = (const char *)fdt - input_base;
+        rec->flags = PACK_IN_INPUT;
+    } else {
+        // 8 byte aligned, so they can be used in place
+        rec->offset = payload_size;
+        rc = write_full(payload_fd, fdt, fdtsize);
+        if (!rc && (fdtsize & 7))
+            rc = write_full(payload_fd, zeroes, 8 - (fdtsize & 7));
+        if (rc) {
+            fprintf(stderr, "Can't write file %s\n", PACK_PAYLOAD);
+            return rc;
+        }
+        payload_size += ROUNDUP((uint64_t)fdtsize, 8);
+    }
+
+    sha256(fdt, fdtsize, rec->hash);
+
+    afdt = fdt_aligned(fdt, fdtsize, &copy);
+    if (!afdt)
+        return -ENOMEM;
+    node = fdt_path_offset(afdt, "/");
+    rec->compatible = PACK_NO_STRING;
+    rec->model = PACK_NO_STRING;
+    if (node >= 0) {
+        const char *str = fdt_getprop(afdt, node, "compatible", &len);
+        rec->compatible = pack_string(str, len);
+        str = fdt_getprop(afdt, node, "model", &len);
+        rec->model = pack_string(str, len);
+    }
+    free(copy);
+
+    pack_count++;
+    return 0;
+}
+
+static int pack_start(const char *outdir)
+{
+    char filename[PATH_MAX];
+    int rc;
+
+    rc = snprintf(filename, sizeof(filename), "%s/%s", outdir, PACK_PAYLOAD);
+    if (rc<0 || (size_t)rc>=sizeof(filename)) {
+        fprintf(stderr, "Can't build filename\n");
+        return -ENAMETOOLONG;
+    }
+
+    payload_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (payload_fd < 0) {
+        fprintf(stderr, "Can't open file %s\n", filename);
+        return -errno;
+    }
+
+    return 0;
+}
+
+/*
+ * Write the index: a header of magic, version, DTB count, record size,
+ * string table offset and size and the string offsets of the input and
+ * payload file names, then a record per DTB of offset (u64), size, flags,
+ * the string offsets of the first 'compatible' and of 'model' and the
+ * SHA-256 of the DTB.  All little endian, strings are NUL terminated.
+ */
+static int pack_finish(const char *outdir, const char *input)
+{
+    char filename[PATH_MAX];
+    unsigned char buf[PACK_HEADER_SIZE > PACK_RECORD_SIZE ? PACK_HEADER_SIZE : PACK_RECORD_SIZE];
+    unsigned char *p;
+    uint32_t i, input_name, payload_name;
+    int fd, rc;
+
+    if (close(payload_fd)) {
+        payload_fd = -1;
+        fprintf(stderr, "Can't close file %s\n", PACK_PAYLOAD);
+        return -EIO;
+    }
+    payload_fd = -1;
+
+    input_name = pack_string(input, strlen(input) + 1);
+    payload_name = pack_string(PACK_PAYLOAD, sizeof(PACK_PAYLOAD));
+
+    rc = snprintf(filename, sizeof(filename), "%s/%s", outdir, PACK_INDEX);
+    if (rc<0 || (size_t)rc>=sizeof(filename)) {
+        fprintf(stderr, "Can't build filename\n");
+        return -ENAMETOOLONG;
+    }
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open file %s\n", filename);
+        return -errno;
+    }
+
+    memcpy(buf, PACK_MAGIC, 4);
+    p = put_u32(buf + 4, PACK_VERSION);
+    p = put_u32(p, pack_count);
+    p = put_u32(p, PACK_RECORD_SIZE);
+    p = put_u32(p, PACK_HEADER_SIZE + pack_count * PACK_RECORD_SIZE);
+    p = put_u32(p, pack_strings_size);
+    p = put_u32(p, input_name);
+    put_u32(p, payload_name);
+    rc = write_full(fd, buf, PACK_HEADER_SIZE);
+
+    for (i = 0; !rc && i < pack_count; i++) {
+        p = put_u64(buf, pack_records[i].offset);
+        p = put_u32(p, pack_records[i].size);
+        p = put_u32(p, pack_records[i].flags);
+        p = put_u32(p, pack_records[i].compatible);
+        p = put_u32(p, pack_records[i].model);
+        memcpy(p, pack_records[i].hash, SHA256_DIGEST_SIZE);
+        rc = write_full(fd, buf, PACK_RECORD_SIZE);
+    }
+
+    if (!rc)
+        rc = write_full(fd, pack_strings, pack_strings_size);
+
+    if (close(fd) || rc) {
+        fprintf(stderr, "Can't write file %s\n", filename);
+        return -EIO;
+    }
+
+    printf("packed %u DTBs into %s/%s (%llu bytes), index %s\n", pack_count, outdir,
+           PACK_PAYLOAD, (unsigned long long)payload_size, filename);
+    return 0;
+}
+
+typedef struct {
+    const char *outdir;
+    uint32_t count;
+} extract_ctx_t;
+
+// write the FDTs found by fdt_extract() to outdir/<n>.dtb
+static int write_fdt(void *ctx, const void *fdt, uint32_t fdtsize)
+{
+    extract_ctx_t *x = ctx;
+    const char *outdir = x->outdir;
+    uint32_t i = x->count++;
+    char fdtfilename[PATH_MAX];
+    int rc;
+
+    // filter before any output
+    rc = fdt_filter(fdt, fdtsize);
+    if (rc <= 0)
+        return rc;
+
+    if (pack_mode != PACK_NONE)
+        return pack_fdt(fdt, fdtsize);
+
+    // build filename
+    rc = snprintf(fdtfilename, sizeof(fdtfilename), "%s/%u.dtb", outdir, i);
+    if (rc<0 || (size_t)rc>=sizeof(fdtfilename)) {
+        fprintf(stderr, "Can't build filename\n");
+        return -ENAMETOOLONG;
+    }
+
+    printf("write %s\n", fdtfilename);
+
+    // open file
+    FILE *f = fopen(fdtfilename, "wb+");
+    if (!f) {
+        fprintf(stderr, "Can't open file %s\n", fdtfilename);
+        return -errno;
+    }
+
+    // write dtb
+    if (fwrite(fdt, fdtsize, 1, f) != 1) {
+        fprintf(stderr, "Can't write file %s\n", fdtfilename);
+        fclose(f);
+        return -EIO;
+    }
+
+    // close file
+    if (fclose(f)) {
+        fprintf(stderr, "Can't close file %s\n", fdtfilename);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [--pack | --reference] [filters] fdt.img outdir\n", name);
+    fprintf(stderr, "  -p, --pack       write all DTBs to outdir/" PACK_PAYLOAD " with an index in\n");
+    fprintf(stderr, "                   outdir/" PACK_INDEX " instead of a file per DTB\n");
+    fprintf(stderr, "  -r, --reference  like --pack, but the index refers to the DTBs in fdt.img\n");
+    fprintf(stderr, "                   where possible, only decompressed ones are written\n");
+    fprintf(stderr, "Only write DTBs whose root node matches all of:\n");
+    fprintf(stderr, "  -c, --compatible <pattern>   any 'compatible' string, shell pattern\n");
+    fprintf(stderr, "  -m, --model <pattern>        'model', shell pattern\n");
+    fprintf(stderr, "  -i, --msm-id <chipset[:rev]> a 'qcom,msm-id' entry\n");
+    fprintf(stderr, "  -b, --board-id <platform[:subtype]> a 'qcom,board-id' entry\n");
+}
+
+// parse a[:b] into cells, returns the number of cells or -1
+static int parse_cells(const char *str, uint32_t cells[2])
+{
+    char *end;
+    int n;
+
+    for (n = 0; n < 2; n++) {
+        cells[n] = strtoul(str, &end, 0);
+        if (end == str)
+            return -1;
+        if (!*end)
+            return n + 1;
+        if (*end != ':')
+            return -1;
+        str = end + 1;
+    }
+
+    return -1;
+}
+
 int main(int argc, char **argv)
 {
     int rc;
     off_t off;
     void *fdtimg = NULL;
+    int mapped = 0;
     ssize_t ssize;
+    extract_ctx_t ctx;
+    int c;
+
+    static const struct option long_options[] = {
+        {"pack",      no_argument, 0, 'p'},
+        {"reference", no_argument, 0, 'r'},
+        {"compatible", required_argument, 0, 'c'},
+        {"model",     required_argument, 0, 'm'},
+        {"msm-id",    required_argument, 0, 'i'},
+        {"board-id",  required_argument, 0, 'b'},
+        {"help",      no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while ((c = getopt_long(argc, argv, "prc:m:i:b:h", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'p':
+                pack_mode = PACK_FILE;
+                break;
+            case 'r':
+                pack_mode = PACK_REFERENCE;
+                break;
+            case 'c':
+                filter_compatible = optarg;
+                break;
+            case 'm':
+                filter_model = optarg;
+                break;
+            case 'i':
+                filter_msm_id_cells = parse_cells(optarg, filter_msm_id);
+                if (filter_msm_id_cells < 0) {
+                    fprintf(stderr, "Invalid msm-id '%s'\n", optarg);
+                    return -EINVAL;
+                }
+                break;
+            case 'b':
+                filter_board_id_cells = parse_cells(optarg, filter_board_id);
+                if (filter_board_id_cells < 0) {
+                    fprintf(stderr, "Invalid board-id '%s'\n", optarg);
+                    return -EINVAL;
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                return -EINVAL;
+        }
+    }
 
     // validate arguments
-    if (argc!=3) {
-        fprintf(stderr, "Usage: %s fdt.img outdir\n", argv[0]);
+    if (argc - optind != 2) {
+        print_usage(argv[0]);
         return -EINVAL;
     }
+    const char *outdir = argv[optind + 1];
 
     // open file
-    const char *filename = argv[1];
+    const char *filename = argv[optind];
     int fd = open(filename, O_RDONLY);
     if (fd<0) {
         fprintf(stderr, "Can't open file %s\n", filename);
@@ -78,61 +614,54 @@ int main(int argc, char **argv)
         goto close_file;
     }
 
-    // allocate buffer
-    fdtimg = malloc(off);
-    if (!fdtimg) {
-        fprintf(stderr, "Can't allocate buffer of size %lu\n", off);
-        rc = -ENOMEM;
-        goto close_file;
-    }
-
-    // read file into memory
-    ssize = read(fd, fdtimg, off);
-    if (ssize!=off) {
-        fprintf(stderr, "Can't read file %s into buffer\n", filename);
-        rc = (int)ssize;
-        goto free_buffer;
-    }
-
-    void *fdt = fdtimg;
-    uint32_t i = 0;
-    while (fdt+sizeof(struct fdt_header) < fdt+off) {
-        if (fdt_check_header(fdt)) break;
-        uint32_t fdtsize = fdt_totalsize(fdt);
-
-        // build filename
-        char fdtfilename[PATH_MAX];
-        rc = snprintf(fdtfilename, sizeof(fdtfilename), "%s/%u.dtb", argv[2], i++);
-        if (rc<0 || (size_t)rc>=sizeof(fdtfilename)) {
-            fprintf(stderr, "Can't build filename\n");
-            return rc;
+    // map the file, the DTBs are written straight from it
+    fdtimg = off ? mmap(NULL, off, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (fdtimg != MAP_FAILED) {
+        mapped = 1;
+    } else {
+        // allocate buffer
+        fdtimg = malloc(off + 1);
+        if (!fdtimg) {
+            fprintf(stderr, "Can't allocate buffer of size %lu\n", off);
+            rc = -ENOMEM;
+            goto close_file;
         }
-        rc = 0;
-
-        printf("write %s\n", fdtfilename);
 
-        // open file
-        FILE *f = fopen(fdtfilename, "wb+");
-        if (!f) {
-            fprintf(stderr, "Can't open file %s\n", fdtfilename);
-            return -1;
+        // read file into memory
+        ssize = read_full(fd, fdtimg, off);
+        if (ssize!=off) {
+            fprintf(stderr, "Can't read file %s into buffer\n", filename);
+            rc = ssize < 0 ? -errno : -EIO;
+            goto free_buffer;
         }
+    }
 
-        // write dtb
-        fwrite(fdt, fdtsize, 1, f);
+    if (pack_mode != PACK_NONE) {
+        input_base = fdtimg;
+        input_size = off;
+        rc = pack_start(outdir);
+        if (rc)
+            goto free_buffer;
+    }
 
-        // close file
-        if (fclose(f)) {
-            fprintf(stderr, "Can't close file %s\n", fdtfilename);
-            return -1;
-        }
+    ctx.outdir = outdir;
+    ctx.count = 0;
+    rc = fdt_extract(fdtimg, off, write_fdt, &ctx);
 
-        fdt += fdtsize;
+    if (pack_mode != PACK_NONE) {
+        if (!rc)
+            rc = pack_finish(outdir, filename);
+        else
+            close(payload_fd);
+        free(pack_records);
+        free(pack_strings);
     }
 
-
 free_buffer:
-    free(fdtimg);
+    if (mapped)
+        munmap(fdtimg, off);
+    else
+        free(fdtimg);
 
 close_file:
     // close file
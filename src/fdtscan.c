@@ -0,0 +1,377 @@
+/*
+ * Finds the FDTs in a blob like a kernel image with appended DTBs, see
+ * fdtscan.h.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <zlib.h>
+#include <libfdt.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4frame.h>
+#endif
+
+#include <fdtscan.h>
+
+// FDT_MAGIC in the big endian byte order of the header
+static const unsigned char fdt_magic_bytes[4] = { 0xd0, 0x0d, 0xfe, 0xed };
+
+// largest FDT taken from a compressed stream, bounds the window
+#define FDT_STREAM_MAX (64 * 1024 * 1024)
+// decompressed bytes per step
+#define STREAM_CHUNK (256 * 1024)
+
+#ifdef HAVE_LZ4
+// legacy format as used for the kernel's Image.lz4, blocks of up to 8MB
+#define LZ4_LEGACY_MAGIC 0x184c2102
+#define LZ4_LEGACY_BLOCK (8 * 1024 * 1024)
+#endif
+
+// returns the size of the valid FDT at fdt, or 0
+static uint32_t fdt_valid(const void *fdt, size_t left)
+{
+    struct fdt_header hdr;
+    uint32_t fdtsize;
+
+    if (left < sizeof(hdr))
+        return 0;
+
+    // candidates can be at any alignment
+    memcpy(&hdr, fdt, sizeof(hdr));
+    if (fdt_check_header(&hdr))
+        return 0;
+
+    fdtsize = fdt_totalsize(&hdr);
+    if (fdtsize < sizeof(struct fdt_header) || fdtsize > left)
+        return 0;
+
+    // a truncated blob would swallow the start of the next one
+    if (fdt_version(&hdr) >= 17) {
+        uint32_t off = fdt_off_dt_struct(&hdr);
+        uint32_t size = fdt_size_dt_struct(&hdr);
+        fdt32_t tag;
+
+        if (size < sizeof(tag) || off > fdtsize || size > fdtsize - off)
+            return 0;
+
+        memcpy(&tag, (const char *)fdt + off + size - sizeof(tag), sizeof(tag));
+        if (fdt32_to_cpu(tag) != FDT_END)
+            return 0;
+    }
+
+    return fdtsize;
+}
+
+/*
+ * Pass every valid FDT in data to found.  Candidates are found by their
+ * magic, so padding, vendor headers, kernels or broken blobs in between
+ * are skipped, and the data is only passed once.
+ */
+static int fdt_scan(const char *data, size_t size, fdt_found_t found, void *ctx)
+{
+    const char *p = data;
+    const char *end = data + size;
+    uint32_t fdtsize;
+    int rc;
+
+    while ((size_t)(end - p) >= sizeof(struct fdt_header)) {
+        p = memmem(p, end - p, fdt_magic_bytes, sizeof(fdt_magic_bytes));
+        if (!p)
+            break;
+
+        fdtsize = fdt_valid(p, end - p);
+        if (!fdtsize) {
+            // no FDT here, resync at the next magic
+            p++;
+            continue;
+        }
+
+        rc = found(ctx, p, fdtsize);
+        if (rc)
+            return rc;
+
+        p += fdtsize;
+    }
+
+    return 0;
+}
+
+/*
+ * Scanner for decompressed data, which only keeps a window of the stream:
+ * the bytes from the current candidate on, at most FDT_STREAM_MAX.
+ */
+typedef struct {
+    fdt_found_t found;
+    void *ctx;
+    char *buf;
+    size_t start;               // buf[start..len) is yet to be scanned
+    size_t len;
+    size_t cap;
+} fdt_stream_t;
+
+// returns room for at least size more bytes at buf + len
+static char *fdt_stream_space(fdt_stream_t *s, size_t size)
+{
+    char *buf;
+
+    if (s->start) {
+        memmove(s->buf, s->buf + s->start, s->len - s->start);
+        s->len -= s->start;
+        s->start = 0;
+    }
+
+    if (s->cap - s->len < size) {
+        buf = realloc(s->buf, s->len + size);
+        if (!buf)
+            return NULL;
+        s->buf = buf;
+        s->cap = s->len + size;
+    }
+
+    return s->buf + s->len;
+}
+
+// scan what's in the window, at the end of the stream incomplete candidates are dropped
+static int fdt_stream_scan(fdt_stream_t *s, int final)
+{
+    struct fdt_header hdr;
+    uint32_t fdtsize;
+    size_t avail;
+    char *p;
+    int rc;
+
+    for (;;) {
+        avail = s->len - s->start;
+        p = memmem(s->buf + s->start, avail, fdt_magic_bytes, sizeof(fdt_magic_bytes));
+        if (!p) {
+            // keep what could be the start of a magic
+            if (avail > sizeof(fdt_magic_bytes) - 1)
+                s->start = s->len - (sizeof(fdt_magic_bytes) - 1);
+            return 0;
+        }
+        s->start = p - s->buf;
+        avail = s->len - s->start;
+
+        if (avail < sizeof(hdr))
+            return 0;
+
+        memcpy(&hdr, p, sizeof(hdr));
+        fdtsize = fdt_totalsize(&hdr);
+        if (fdt_check_header(&hdr) || fdtsize < sizeof(hdr) || fdtsize > FDT_STREAM_MAX) {
+            s->start++;
+            continue;
+        }
+
+        if (avail < fdtsize) {
+            if (!final)
+                return 0;
+            // can't be one, there may be more after it
+            s->start++;
+            continue;
+        }
+
+        fdtsize = fdt_valid(p, avail);
+        if (!fdtsize) {
+            s->start++;
+            continue;
+        }
+
+        rc = s->found(s->ctx, p, fdtsize);
+        if (rc)
+            return rc;
+        s->start += fdtsize;
+    }
+}
+
+/*
+ * Inflate a gzip stream, *used is the size of its compressed data.  Broken
+ * or truncated data ends the stream, but isn't an error.
+ */
+static int gunzip_scan(fdt_stream_t *s, const unsigned char *data, size_t size, size_t *used)
+{
+    const unsigned char *end = data + size;
+    z_stream strm;
+    char *out;
+    int ret, rc = 0;
+
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK)
+        return -ENOMEM;
+
+    strm.next_in = (unsigned char *)data;
+    for (;;) {
+        out = fdt_stream_space(s, STREAM_CHUNK);
+        if (!out) {
+            rc = -ENOMEM;
+            break;
+        }
+
+        // zlib counts in uInt
+        if (!strm.avail_in)
+            strm.avail_in = end - strm.next_in > UINT_MAX ? UINT_MAX : end - strm.next_in;
+        strm.next_out = (unsigned char *)out;
+        strm.avail_out = STREAM_CHUNK;
+
+        ret = inflate(&strm, Z_NO_FLUSH);
+        s->len += (char *)strm.next_out - out;
+
+        rc = fdt_stream_scan(s, 0);
+        if (rc)
+            break;
+
+        if (ret == Z_STREAM_END) {
+            // concatenated members, like gzip itself handles them
+            if (end - strm.next_in >= 2 && strm.next_in[0] == 0x1f && strm.next_in[1] == 0x8b) {
+                inflateReset(&strm);
+                continue;
+            }
+            break;
+        }
+        if (ret == Z_BUF_ERROR && strm.next_in == end) {
+            fprintf(stderr, "gzip data is truncated\n");
+            break;
+        }
+        // the rest is scanned as it is
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            fprintf(stderr, "Can't decompress gzip data\n");
+            break;
+        }
+    }
+
+    *used = strm.next_in - data;
+    inflateEnd(&strm);
+    return rc;
+}
+
+#ifdef HAVE_LZ4
+static int lz4_frame_scan(fdt_stream_t *s, const unsigned char *data, size_t size, size_t *used)
+{
+    LZ4F_decompressionContext_t ctx;
+    size_t pos = 0, in, out, ret;
+    char *dst;
+    int rc = 0;
+
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+        return -ENOMEM;
+
+    do {
+        dst = fdt_stream_space(s, STREAM_CHUNK);
+        if (!dst) {
+            rc = -ENOMEM;
+            break;
+        }
+
+        in = size - pos;
+        out = STREAM_CHUNK;
+        ret = LZ4F_decompress(ctx, dst, &out, data + pos, &in, NULL);
+        if (LZ4F_isError(ret)) {
+            fprintf(stderr, "Can't decompress lz4 data: %s\n", LZ4F_getErrorName(ret));
+            break;
+        }
+        pos += in;
+        s->len += out;
+
+        rc = fdt_stream_scan(s, 0);
+        if (rc)
+            break;
+
+        if (!in && !out) {
+            fprintf(stderr, "lz4 data is truncated\n");
+            break;
+        }
+    } while (ret);
+
+    *used = pos;
+    LZ4F_freeDecompressionContext(ctx);
+    return rc;
+}
+
+// the legacy format has no end marker, it ends where no block follows
+static int lz4_legacy_scan(fdt_stream_t *s, const unsigned char *data, size_t size, size_t *used)
+{
+    size_t pos = 4;
+    uint32_t csize;
+    char *dst;
+    int ret, rc = 0;
+
+    while (size - pos >= 4) {
+        csize = data[pos] | data[pos + 1] << 8 | data[pos + 2] << 16 | (uint32_t)data[pos + 3] << 24;
+        if (csize > (uint32_t)LZ4_compressBound(LZ4_LEGACY_BLOCK) || csize > size - pos - 4)
+            break;
+
+        dst = fdt_stream_space(s, LZ4_LEGACY_BLOCK);
+        if (!dst) {
+            rc = -ENOMEM;
+            break;
+        }
+
+        ret = LZ4_decompress_safe((const char *)data + pos + 4, dst, csize, LZ4_LEGACY_BLOCK);
+        if (ret < 0)
+            break;
+        pos += 4 + csize;
+        s->len += ret;
+
+        rc = fdt_stream_scan(s, 0);
+        if (rc)
+            break;
+    }
+
+    *used = pos;
+    return rc;
+}
+#endif
+
+/*
+ * Compressed data at the start, like Image.gz-dtb or a compressed blob of
+ * DTBs, is decompressed on the fly and scanned as it comes.  The rest, e.g.
+ * the DTBs appended to the compressed kernel, is scanned in place.
+ */
+int fdt_extract(const unsigned char *data, size_t size, fdt_found_t found, void *ctx)
+{
+    fdt_stream_t s;
+    size_t pos = 0, used;
+    int rc = 0;
+
+    memset(&s, 0, sizeof(s));
+    s.found = found;
+    s.ctx = ctx;
+
+    while (!rc && size - pos >= 4) {
+        const unsigned char *p = data + pos;
+#ifdef HAVE_LZ4
+        uint32_t magic = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+#endif
+
+        used = 0;
+        if (p[0] == 0x1f && p[1] == 0x8b) {
+            rc = gunzip_scan(&s, p, size - pos, &used);
+#ifdef HAVE_LZ4
+        } else if (magic == LZ4F_MAGICNUMBER) {
+            rc = lz4_frame_scan(&s, p, size - pos, &used);
+        } else if (magic == LZ4_LEGACY_MAGIC) {
+            rc = lz4_legacy_scan(&s, p, size - pos, &used);
+#endif
+        } else {
+            break;
+        }
+
+        if (!rc)
+            rc = fdt_stream_scan(&s, 1);
+        s.start = s.len = 0;
+        pos += used;
+        if (!used)
+            break;
+    }
+    free(s.buf);
+
+    if (!rc)
+        rc = fdt_scan((const char *)data + pos, size - pos, found, ctx);
+
+    return rc;
+}
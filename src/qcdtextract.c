@@ -26,6 +26,7 @@
  * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -34,226 +35,1552 @@
 #include <string.h>
 #include <stdint.h>
 #include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <zlib.h>
 
-#include <list.h>
 #include <lib/boot.h>
 #include <lib/boot/qcdt.h>
 #include <lib/boot/internal/qcdt.h>
 
+#include <sha256.h>
+
+#define INDEX_JSON   0
+#define INDEX_BINARY 1
+
+// binary index: header, then one record per entry, all little endian
+#define INDEX_MAGIC       "QIDX"
+#define INDEX_VERSION     1
+#define INDEX_HEADER_SIZE 16
+#define INDEX_RECORD_SIZE (11 * 4 + SHA256_DIGEST_SIZE)
+
+// how entries sharing a DTB with an earlier one are written
+#define LINK_NONE    0
+#define LINK_HARD    1
+#define LINK_SYMBOLIC 2
+#define LINK_REFLINK 3
+
+static int link_mode = LINK_NONE;
+static FILE *manifest;
+
+// set of the offsets of the DTBs which were written already
+typedef struct {
+    uint32_t *offsets;
+    uint32_t *indices;          // entry which the DTB was written for
+    uint8_t *used;
+    size_t size;
+} offset_set_t;
+
+static int offset_set_init(offset_set_t *set, size_t count)
+{
+    set->size = 16;
+    while (set->size < count * 2)
+        set->size *= 2;
+
+    set->offsets = calloc(set->size, sizeof(*set->offsets));
+    set->indices = calloc(set->size, sizeof(*set->indices));
+    set->used = calloc(set->size, sizeof(*set->used));
+    if (!set->offsets || !set->indices || !set->used) {
+        free(set->offsets);
+        free(set->indices);
+        free(set->used);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static void offset_set_free(offset_set_t *set)
+{
+    free(set->offsets);
+    free(set->indices);
+    free(set->used);
+}
+
+// returns the slot of offset, which is unused if it isn't in the set
+static size_t offset_set_find(offset_set_t *set, uint32_t offset)
+{
+    size_t i = (offset * 2654435761u) & (set->size - 1);
+
+    while (set->used[i] && set->offsets[i] != offset)
+        i = (i + 1) & (set->size - 1);
+
+    return i;
+}
+
+static void log_offset(offset_set_t *set, uint32_t offset, uint32_t index)
+{
+    size_t i = offset_set_find(set, offset);
+
+    set->offsets[i] = offset;
+    set->indices[i] = index;
+    set->used[i] = 1;
+}
+
+// returns whether offset was written already, and for which entry
+static int has_offset(offset_set_t *set, uint32_t offset, uint32_t *index)
+{
+    size_t i = offset_set_find(set, offset);
+
+    *index = set->indices[i];
+    return set->used[i];
+}
+
+off_t fdsize(int fd)
+{
+    off_t off;
+
+    off = lseek(fd, 0L, SEEK_END);
+    lseek(fd, 0L, SEEK_SET);
+
+    return off;
+}
+
+// read the whole file, short reads are retried
+static ssize_t read_full(int fd, void *buf, size_t size)
+{
+    size_t off = 0;
+    ssize_t ret;
+
+    while (off < size) {
+        ret = read(fd, (char *)buf + off, size - off);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return ret;
+        if (ret == 0)
+            break;
+        off += ret;
+    }
+
+    return off;
+}
+
+static int write_file(const char *filename, const void *data, size_t size)
+{
+    const char *p = data;
+    ssize_t ret;
+    int fd;
+
+    // open file
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open file %s\n", filename);
+        return -1;
+    }
+
+    // write straight from the image
+    while (size > 0) {
+        ret = write(fd, p, size);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            fprintf(stderr, "Can't write file %s\n", filename);
+            close(fd);
+            return -1;
+        }
+        p += ret;
+        size -= ret;
+    }
+
+    // close file
+    if (close(fd)) {
+        fprintf(stderr, "Can't close file %s\n", filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int is_gzip(const void *data, size_t size)
+{
+    const unsigned char *p = data;
+
+    return size >= 18 && p[0] == 0x1f && p[1] == 0x8b;
+}
+
+/*
+ * Inflate a gzip image into an anonymous mapping which grows as needed, so
+ * there's no temporary file and only the decompressed image is resident.
+ * On success *dst is a mapping of *capacity bytes holding *dstsize bytes.
+ */
+static int gunzip_image(const void *src, size_t srcsize, void **dst, size_t *dstsize, size_t *capacity)
+{
+    const unsigned char *tail = (const unsigned char *)src + srcsize - 4;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t cap, used = 0;
+    unsigned char *out, *newout;
+    z_stream strm;
+    int ret;
+
+    // ISIZE of the last member is the size mod 2^32, good enough as a hint
+    cap = (size_t)tail[0] | (size_t)tail[1] << 8 | (size_t)tail[2] << 16 | (size_t)tail[3] << 24;
+    if (cap < srcsize)
+        cap = srcsize * 4;
+    cap = (cap + page - 1) & ~(page - 1);
+
+    out = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (out == MAP_FAILED)
+        return -ENOMEM;
+
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK) {
+        munmap(out, cap);
+        return -ENOMEM;
+    }
+
+    strm.next_in = (unsigned char *)src;
+    strm.avail_in = 0;
+    do {
+        if (used == cap) {
+            newout = mremap(out, cap, cap * 2, MREMAP_MAYMOVE);
+            if (newout == MAP_FAILED) {
+                ret = Z_MEM_ERROR;
+                break;
+            }
+            out = newout;
+            cap *= 2;
+        }
+
+        // zlib counts in uInt
+        if (!strm.avail_in) {
+            size_t left = (const unsigned char *)src + srcsize - strm.next_in;
+            strm.avail_in = left > UINT_MAX ? UINT_MAX : left;
+        }
+        strm.next_out = out + used;
+        strm.avail_out = cap - used > UINT_MAX ? UINT_MAX : cap - used;
+
+        ret = inflate(&strm, Z_NO_FLUSH);
+        used = strm.next_out - out;
+
+        // concatenated members, like gzip itself handles them
+        if (ret == Z_STREAM_END && is_gzip(strm.next_in, tail + 4 - strm.next_in)) {
+            ret = inflateReset(&strm);
+        }
+    } while (ret == Z_OK || (ret == Z_BUF_ERROR && used == cap));
+
+    inflateEnd(&strm);
+
+    if (ret != Z_STREAM_END) {
+        munmap(out, cap);
+        return ret == Z_MEM_ERROR ? -ENOMEM : -EINVAL;
+    }
+
+    *dst = out;
+    *dstsize = used;
+    *capacity = cap;
+    return 0;
+}
+
+// returns the size of the entries in table, 0 if the version isn't supported
+static uint32_t dev_tree_entry_size(const dt_table_t *table)
+{
+    uint32_t entry_size;
+
+    switch (table->version & 0xff) {
+        case DEV_TREE_VERSION_V1:
+            entry_size =  sizeof(dt_entry_v1_t);
+            break;
+        case DEV_TREE_VERSION_V2:
+            entry_size = sizeof(dt_entry_v2_t);
+            break;
+        case DEV_TREE_VERSION_V3:
+            entry_size = sizeof(dt_entry_t);
+            break;
+        default:
+            return 0;
+    }
+
+    // motorola model name
+    if (table->version >> 8) {
+        entry_size += 32;
+    }
+
+    return entry_size;
+}
+
+// decode an entry of any version into the v3 layout, the way LK does it
+static void dev_tree_read_entry(uint32_t qcdt_version, const unsigned char *table_ptr,
+                                dt_entry_t *cur_dt_entry)
+{
+    const dt_entry_v1_t *dt_entry_v1 = NULL;
+    const dt_entry_v2_t *dt_entry_v2 = NULL;
+
+    memset(cur_dt_entry, 0, sizeof(*cur_dt_entry));
+    switch (qcdt_version) {
+        case DEV_TREE_VERSION_V1:
+            dt_entry_v1 = (const dt_entry_v1_t *)table_ptr;
+            cur_dt_entry->platform_id = dt_entry_v1->platform_id;
+            cur_dt_entry->variant_id = dt_entry_v1->variant_id;
+            cur_dt_entry->soc_rev = dt_entry_v1->soc_rev;
+            cur_dt_entry->board_hw_subtype = (dt_entry_v1->variant_id >> 0x18);
+            /*cur_dt_entry->pmic_rev[0] = board_pmic_target(0);
+            cur_dt_entry->pmic_rev[1] = board_pmic_target(1);
+            cur_dt_entry->pmic_rev[2] = board_pmic_target(2);
+            cur_dt_entry->pmic_rev[3] = board_pmic_target(3);*/
+            cur_dt_entry->offset = dt_entry_v1->offset;
+            cur_dt_entry->size = dt_entry_v1->size;
+            break;
+        case DEV_TREE_VERSION_V2:
+            dt_entry_v2 = (const dt_entry_v2_t *)table_ptr;
+            cur_dt_entry->platform_id = dt_entry_v2->platform_id;
+            cur_dt_entry->variant_id = dt_entry_v2->variant_id;
+            cur_dt_entry->soc_rev = dt_entry_v2->soc_rev;
+            /* For V2 version of DTBs we have platform version field as part
+             * of variant ID, in such case the subtype will be mentioned as 0x0
+             * As the qcom, board-id = <0xSSPMPmPH, 0x0>
+             * SS -- Subtype
+             * PM -- Platform major version
+             * Pm -- Platform minor version
+             * PH -- Platform hardware CDP/MTP
+             * In such case to make it compatible with LK algorithm move the subtype
+             * from variant_id to subtype field
+             */
+            if (dt_entry_v2->board_hw_subtype == 0)
+                cur_dt_entry->board_hw_subtype = (cur_dt_entry->variant_id >> 0x18);
+            else
+                cur_dt_entry->board_hw_subtype = dt_entry_v2->board_hw_subtype;
+            /*cur_dt_entry->pmic_rev[0] = board_pmic_target(0);
+            cur_dt_entry->pmic_rev[1] = board_pmic_target(1);
+            cur_dt_entry->pmic_rev[2] = board_pmic_target(2);
+            cur_dt_entry->pmic_rev[3] = board_pmic_target(3);*/
+            cur_dt_entry->offset = dt_entry_v2->offset;
+            cur_dt_entry->size = dt_entry_v2->size;
+            break;
+        case DEV_TREE_VERSION_V3:
+            memcpy(cur_dt_entry, (const dt_entry_t *)table_ptr,
+                   sizeof(dt_entry_t));
+            /* For V3 version of DTBs we have platform version field as part
+             * of variant ID, in such case the subtype will be mentioned as 0x0
+             * As the qcom, board-id = <0xSSPMPmPH, 0x0>
+             * SS -- Subtype
+             * PM -- Platform major version
+             * Pm -- Platform minor version
+             * PH -- Platform hardware CDP/MTP
+             * In such case to make it compatible with LK algorithm move the subtype
+             * from variant_id to subtype field
+             */
+            if (cur_dt_entry->board_hw_subtype == 0)
+                cur_dt_entry->board_hw_subtype = (cur_dt_entry->variant_id >> 0x18);
+
+            break;
+        default:
+            break;
+    }
+}
+
+// check the table and return its version, or -1
+static int dev_tree_check(size_t filesize, const dt_table_t *table, uint32_t *entry_size)
+{
+    uint32_t qcdt_version = table->version & 0xff;
+
+    *entry_size = dev_tree_entry_size(table);
+    if (!*entry_size) {
+        fprintf(stderr, "ERROR: Unsupported version (%d) in DT table \n", qcdt_version);
+        return -1;
+    }
+
+    if (table->num_entries > (filesize - DEV_TREE_HEADER_SIZE) / *entry_size) {
+        fprintf(stderr, "ERROR: DT table with %u entries doesn't fit into the file\n", table->num_entries);
+        return -1;
+    }
+
+    return qcdt_version;
+}
+
+// check that the DTB of an entry is inside the file
+static int dev_tree_check_entry(size_t filesize, const dt_entry_t *cur_dt_entry, uint32_t i)
+{
+    if (cur_dt_entry->offset > filesize) {
+        fprintf(stderr, "ERROR: offset %lx of entry %u is greate than the filesize %lx\n", (uint64_t)cur_dt_entry->offset, i, (uint64_t)filesize);
+        return -1;
+    }
+    if (cur_dt_entry->size > filesize - cur_dt_entry->offset) {
+        fprintf(stderr, "ERROR: entry %u ends after the end of the file\n", i);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void print_entry(const char *prefix, const dt_entry_t *cur_dt_entry)
+{
+    fprintf(stdout, "%s chipset: %u, rev: %u, platform: %u, subtype: %u, pmic0: %u, pmic1: %u, pmic2: %u, pmic3: %u\n",
+            prefix,
+            cur_dt_entry->platform_id, cur_dt_entry->soc_rev, cur_dt_entry->variant_id, cur_dt_entry->board_hw_subtype,
+            cur_dt_entry->pmic_rev[0], cur_dt_entry->pmic_rev[1], cur_dt_entry->pmic_rev[2], cur_dt_entry->pmic_rev[3]);
+}
+
+// write the DTB of entry i to directory/i.dtb
+static int write_file_entry(const char *directory, const void *data, size_t size, uint32_t i)
+{
+    char filename[PATH_MAX];
+    int rc;
+
+    // build filename
+    rc = snprintf(filename, sizeof(filename), "%s/%u.dtb", directory, i);
+    if (rc<0 || (size_t)rc>=sizeof(filename)) {
+        fprintf(stderr, "Can't build filename\n");
+        return -1;
+    }
+
+    // write dtb
+    return write_file(filename, data, size);
+}
+
+static int write_entry(const char *directory, const dt_table_t *table,
+                       const dt_entry_t *cur_dt_entry, uint32_t i)
+{
+    return write_file_entry(directory, ((const char *)table) + cur_dt_entry->offset, cur_dt_entry->size, i);
+}
+
+// copy the rest of src to dst
+static int copy_fd(int src, int dst)
+{
+    char buf[65536];
+    ssize_t ret, wret, off;
+
+    for (;;) {
+        ret = read(src, buf, sizeof(buf));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return ret;
+
+        for (off = 0; off < ret; off += wret) {
+            wret = write(dst, buf + off, ret - off);
+            if (wret < 0 && errno == EINTR)
+                wret = 0;
+            else if (wret <= 0)
+                return -1;
+        }
+    }
+}
+
+/*
+ * Materialize entry i, which shares its DTB with entry first, as a link to
+ * first's file.  Reflinks fall back to a copy, like cp --reflink=auto.
+ */
+static int link_entry(const char *directory, uint32_t first, uint32_t i)
+{
+    char target[PATH_MAX];
+    char filename[PATH_MAX];
+    int rc, src, dst;
+
+    rc = snprintf(target, sizeof(target), "%s/%u.dtb", directory, first);
+    if (rc<0 || (size_t)rc>=sizeof(target)) {
+        fprintf(stderr, "Can't build filename\n");
+        return -1;
+    }
+    rc = snprintf(filename, sizeof(filename), "%s/%u.dtb", directory, i);
+    if (rc<0 || (size_t)rc>=sizeof(filename)) {
+        fprintf(stderr, "Can't build filename\n");
+        return -1;
+    }
+
+    if (unlink(filename) && errno != ENOENT) {
+        fprintf(stderr, "Can't remove file %s\n", filename);
+        return -1;
+    }
+
+    switch (link_mode) {
+        case LINK_HARD:
+            rc = link(target, filename);
+            break;
+        case LINK_SYMBOLIC:
+            // relative, so the output directory can be moved
+            snprintf(target, sizeof(target), "%u.dtb", first);
+            rc = symlink(target, filename);
+            break;
+        default:
+            src = open(target, O_RDONLY);
+            if (src < 0) {
+                rc = -1;
+                break;
+            }
+            dst = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (dst < 0) {
+                close(src);
+                rc = -1;
+                break;
+            }
+            rc = ioctl(dst, FICLONE, src);
+            if (rc)
+                rc = copy_fd(src, dst);
+            close(src);
+            if (close(dst))
+                rc = -1;
+            break;
+    }
+
+    if (rc) {
+        fprintf(stderr, "Can't link file %s to %s\n", filename, target);
+        return -1;
+    }
+
+    return 0;
+}
+
+// one line per entry, so entry i is on line i + 2
+static void manifest_entry(const dt_entry_t *cur_dt_entry, uint32_t i, const char *file)
+{
+    if (!manifest)
+        return;
+
+    fprintf(manifest, "%u %u %u %u %u %u %u %u %u %u %u %s\n", i,
+            cur_dt_entry->platform_id, cur_dt_entry->soc_rev,
+            cur_dt_entry->variant_id, cur_dt_entry->board_hw_subtype,
+            cur_dt_entry->pmic_rev[0], cur_dt_entry->pmic_rev[1],
+            cur_dt_entry->pmic_rev[2], cur_dt_entry->pmic_rev[3],
+            cur_dt_entry->offset, cur_dt_entry->size, file);
+}
+
+// manifest line of an extracted entry, first is the entry which wrote its DTB
+static void manifest_extracted(const dt_entry_t *cur_dt_entry, uint32_t i, uint32_t first)
+{
+    char file[16];
+
+    snprintf(file, sizeof(file), "%u.dtb", link_mode == LINK_NONE ? first : i);
+    manifest_entry(cur_dt_entry, i, file);
+}
+
+int dev_tree_extract(const char *directory, size_t filesize, dt_table_t *table)
+{
+    uint32_t i;
+    int rc;
+    unsigned char *table_ptr = NULL;
+    dt_entry_t dt_entry_buf_1;
+    dt_entry_t *cur_dt_entry = NULL;
+    offset_set_t offsets;
+    int qcdt_version;
+    uint32_t entry_size;
+
+    table_ptr = (unsigned char *)table + DEV_TREE_HEADER_SIZE;
+    cur_dt_entry = &dt_entry_buf_1;
+
+    qcdt_version = dev_tree_check(filesize, table, &entry_size);
+    if (qcdt_version < 0)
+        return -1;
+
+    rc = offset_set_init(&offsets, table->num_entries);
+    if (rc) {
+        fprintf(stderr, "Can't allocate offset table\n");
+        return rc;
+    }
+
+    fprintf(stdout, "DTB Total entry: %d, DTB version: %d\n", table->num_entries, qcdt_version);
+    for (i = 0; i < table->num_entries; i++) {
+        dev_tree_read_entry(qcdt_version, table_ptr, cur_dt_entry);
+        table_ptr += entry_size;
+
+        rc = dev_tree_check_entry(filesize, cur_dt_entry, i);
+        if (rc)
+            goto free_offsets;
+
+        uint32_t first;
+        int skip = has_offset(&offsets, cur_dt_entry->offset, &first);
+        print_entry(skip ? "[SKIP] " : "[WRITE]", cur_dt_entry);
+
+        if (skip) {
+            if (link_mode != LINK_NONE) {
+                rc = link_entry(directory, first, i);
+                if (rc)
+                    goto free_offsets;
+            }
+            manifest_extracted(cur_dt_entry, i, first);
+            continue;
+        }
+
+        rc = write_entry(directory, table, cur_dt_entry, i);
+        if (rc)
+            goto free_offsets;
+
+        log_offset(&offsets, cur_dt_entry->offset, i);
+        manifest_extracted(cur_dt_entry, i, i);
+    }
+    rc = 0;
+
+free_offsets:
+    offset_set_free(&offsets);
+    return rc;
+}
+
+// one entry of the table for the --jobs writers
+typedef struct {
+    uint32_t index;
+    uint32_t first;             // entry which writes the DTB
+    dt_entry_t entry;
+    int skip;
+    int rc;
+    int done;
+} dt_write_t;
+
+typedef struct {
+    const char *directory;
+    const dt_table_t *table;
+    dt_write_t *writes;
+    uint32_t count;
+    uint32_t next;              // next entry to be picked up by a worker
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} dt_writer_t;
+
+static void *dev_tree_write_worker(void *arg)
+{
+    dt_writer_t *writer = arg;
+    dt_write_t *w;
+    int rc;
+
+    for (;;) {
+        pthread_mutex_lock(&writer->lock);
+        if (writer->failed || writer->next >= writer->count) {
+            pthread_mutex_unlock(&writer->lock);
+            break;
+        }
+        w = &writer->writes[writer->next++];
+        pthread_mutex_unlock(&writer->lock);
+
+        rc = 0;
+        if (!w->skip)
+            rc = write_entry(writer->directory, writer->table, &w->entry, w->index);
+
+        pthread_mutex_lock(&writer->lock);
+        w->rc = rc;
+        w->done = 1;
+        if (rc)
+            writer->failed = 1;
+        pthread_cond_broadcast(&writer->cond);
+        pthread_mutex_unlock(&writer->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * dev_tree_extract() with the DTBs written by a pool of threads.  The table
+ * is decoded up front, the log is printed in table order as the writes
+ * complete.
+ */
+int dev_tree_extract_parallel(const char *directory, size_t filesize, dt_table_t *table, int jobs)
+{
+    uint32_t i, count;
+    int rc, done, decode_rc = 0;
+    unsigned char *table_ptr = NULL;
+    offset_set_t offsets;
+    int qcdt_version;
+    uint32_t entry_size;
+    dt_writer_t writer;
+    dt_write_t *w;
+    pthread_t *threads;
+    int nthreads = 0;
+
+    table_ptr = (unsigned char *)table + DEV_TREE_HEADER_SIZE;
+
+    qcdt_version = dev_tree_check(filesize, table, &entry_size);
+    if (qcdt_version < 0)
+        return -1;
+
+    memset(&writer, 0, sizeof(writer));
+    writer.directory = directory;
+    writer.table = table;
+    writer.writes = calloc(table->num_entries + 1, sizeof(*writer.writes));
+    threads = calloc(jobs, sizeof(*threads));
+    rc = offset_set_init(&offsets, table->num_entries);
+    if (rc || !writer.writes || !threads) {
+        fprintf(stderr, "Can't allocate write table\n");
+        if (!rc)
+            offset_set_free(&offsets);
+        free(writer.writes);
+        free(threads);
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&writer.lock, NULL);
+    pthread_cond_init(&writer.cond, NULL);
+
+    fprintf(stdout, "DTB Total entry: %d, DTB version: %d\n", table->num_entries, qcdt_version);
+
+    // decode, the entries before a broken one are still written
+    for (count = 0; count < table->num_entries; count++) {
+        w = &writer.writes[count];
+        w->index = count;
+        dev_tree_read_entry(qcdt_version, table_ptr, &w->entry);
+        table_ptr += entry_size;
+
+        decode_rc = dev_tree_check_entry(filesize, &w->entry, count);
+        if (decode_rc)
+            break;
+
+        w->skip = has_offset(&offsets, w->entry.offset, &w->first);
+        if (!w->skip) {
+            w->first = count;
+            log_offset(&offsets, w->entry.offset, count);
+        }
+    }
+    writer.count = count;
+
+    while (nthreads < jobs && (uint32_t)nthreads < count) {
+        if (pthread_create(&threads[nthreads], NULL, dev_tree_write_worker, &writer))
+            break;
+        nthreads++;
+    }
+    if (nthreads == 0 && count)
+        dev_tree_write_worker(&writer);
+
+    // log in table order, up to the first failed write; the lock is only
+    // held to wait for an entry, the workers don't touch it once it's done
+    for (i = 0; i < count; i++) {
+        w = &writer.writes[i];
+        pthread_mutex_lock(&writer.lock);
+        while (!w->done && !(writer.failed && i >= writer.next))
+            pthread_cond_wait(&writer.cond, &writer.lock);
+        done = w->done;
+        pthread_mutex_unlock(&writer.lock);
+        if (!done)
+            break;
+
+        print_entry(w->skip ? "[SKIP] " : "[WRITE]", &w->entry);
+        if (w->rc) {
+            rc = w->rc;
+            break;
+        }
+
+        // the first entry of this DTB is done already
+        if (w->skip && link_mode != LINK_NONE) {
+            rc = link_entry(directory, w->first, i);
+            if (rc) {
+                pthread_mutex_lock(&writer.lock);
+                writer.failed = 1;
+                pthread_mutex_unlock(&writer.lock);
+                break;
+            }
+        }
+        manifest_extracted(&w->entry, i, w->first);
+    }
+
+    while (nthreads > 0)
+        pthread_join(threads[--nthreads], NULL);
+
+    if (!rc)
+        rc = decode_rc;
+
+    pthread_cond_destroy(&writer.cond);
+    pthread_mutex_destroy(&writer.lock);
+    offset_set_free(&offsets);
+    free(writer.writes);
+    free(threads);
+    return rc;
+}
+
+// write data to path unless it's there already, returns 1 if it was written
+static int store_object(const char *path, const void *data, size_t size)
+{
+    char tmpname[PATH_MAX];
+    struct stat st;
+    int rc;
+
+    // objects are named by their hash, so an existing one has this content
+    if (!stat(path, &st) && (size_t)st.st_size == size)
+        return 0;
+
+    // write under a temporary name, so a store never has partial objects
+    rc = snprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", path, (int)getpid());
+    if (rc<0 || (size_t)rc>=sizeof(tmpname)) {
+        fprintf(stderr, "Can't build filename\n");
+        return -1;
+    }
+
+    rc = write_file(tmpname, data, size);
+    if (rc)
+        return rc;
+
+    if (rename(tmpname, path)) {
+        fprintf(stderr, "Can't rename file %s to %s\n", tmpname, path);
+        unlink(tmpname);
+        return -1;
+    }
+
+    return 1;
+}
+
+/*
+ * Write the DTBs of a table into the content-addressed store in
+ * store/objects, named by their SHA-256, so identical DTBs of all images
+ * are stored once.  The manifest maps the entries to their objects.
+ */
+int dev_tree_store(const char *store, size_t filesize, dt_table_t *table)
+{
+    uint32_t i, first;
+    int rc;
+    unsigned char *table_ptr = NULL;
+    dt_entry_t dt_entry_buf_1;
+    dt_entry_t *cur_dt_entry = NULL;
+    offset_set_t offsets;
+    int qcdt_version;
+    uint32_t entry_size;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char (*hashes)[SHA256_DIGEST_SIZE * 2 + 1];
+    char object[32 + SHA256_DIGEST_SIZE * 2];
+    char path[PATH_MAX];
+
+    table_ptr = (unsigned char *)table + DEV_TREE_HEADER_SIZE;
+    cur_dt_entry = &dt_entry_buf_1;
+
+    qcdt_version = dev_tree_check(filesize, table, &entry_size);
+    if (qcdt_version < 0)
+        return -1;
+
+    hashes = malloc((table->num_entries + 1) * sizeof(*hashes));
+    rc = offset_set_init(&offsets, table->num_entries);
+    if (rc || !hashes) {
+        fprintf(stderr, "Can't allocate offset table\n");
+        if (!rc)
+            offset_set_free(&offsets);
+        free(hashes);
+        return -ENOMEM;
+    }
+
+    fprintf(stdout, "DTB Total entry: %d, DTB version: %d\n", table->num_entries, qcdt_version);
+    for (i = 0; i < table->num_entries; i++) {
+        dev_tree_read_entry(qcdt_version, table_ptr, cur_dt_entry);
+        table_ptr += entry_size;
+
+        rc = dev_tree_check_entry(filesize, cur_dt_entry, i);
+        if (rc)
+            goto free_hashes;
+
+        // entries sharing a DTB share its hash
+        if (has_offset(&offsets, cur_dt_entry->offset, &first)) {
+            memcpy(hashes[i], hashes[first], sizeof(hashes[i]));
+        } else {
+            sha256(((const char *)table) + cur_dt_entry->offset, cur_dt_entry->size, digest);
+            sha256_to_hex(digest, hashes[i]);
+            log_offset(&offsets, cur_dt_entry->offset, i);
+        }
+
+        snprintf(object, sizeof(object), "objects/%s.dtb", hashes[i]);
+        rc = snprintf(path, sizeof(path), "%s/%s", store, object);
+        if (rc<0 || (size_t)rc>=sizeof(path)) {
+            fprintf(stderr, "Can't build filename\n");
+            rc = -1;
+            goto free_hashes;
+        }
+
+        rc = store_object(path, ((const char *)table) + cur_dt_entry->offset, cur_dt_entry->size);
+        if (rc < 0)
+            goto free_hashes;
+
+        print_entry(rc ? "[WRITE]" : "[SKIP] ", cur_dt_entry);
+        manifest_entry(cur_dt_entry, i, object);
+    }
+    rc = 0;
+
+free_hashes:
+    offset_set_free(&offsets);
+    free(hashes);
+    return rc;
+}
+
+// largest table accepted from a stream, there's no file size to check it against
+#define STREAM_TABLE_MAX (64 * 1024 * 1024)
+
+// one DTB to pick out of a stream
+typedef struct {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t first;             // lowest entry using it, names the file
+} dt_range_t;
+
+static int compare_ranges(const void *a, const void *b)
+{
+    const dt_range_t *ra = a, *rb = b;
+
+    if (ra->offset != rb->offset)
+        return ra->offset < rb->offset ? -1 : 1;
+    return ra->first < rb->first ? -1 : ra->first > rb->first;
+}
+
+// read size bytes, short reads only at the end of the stream
+static ssize_t gz_read_full(gzFile gz, void *buf, size_t size)
+{
+    size_t off = 0;
+    int ret;
+
+    while (off < size) {
+        ret = gzread(gz, (char *)buf + off, size - off > INT_MAX ? INT_MAX : size - off);
+        if (ret < 0)
+            return -1;
+        if (ret == 0)
+            break;
+        off += ret;
+    }
+
+    return off;
+}
+
+// gzseek() can't skip forward in plain pipes, so read what isn't needed
+static int gz_skip(gzFile gz, uint64_t size)
+{
+    char buf[65536];
+    ssize_t ret;
+
+    while (size > 0) {
+        ret = gz_read_full(gz, buf, size > sizeof(buf) ? sizeof(buf) : size);
+        if (ret <= 0)
+            return -1;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+/*
+ * dev_tree_extract() for pipes: read the header and the table, then the
+ * stream forward once, writing every DTB as soon as it's complete.  Only
+ * the table and a window of the size of the largest DTB are kept in
+ * memory.  gzip streams are decompressed on the fly.  The log follows the
+ * order of the DTBs in the file rather than the table.
+ */
+int dev_tree_extract_stream(int fd, const char *directory)
+{
+    uint32_t i, r, count;
+    int rc = -1;
+    gzFile gz;
+    dt_table_t *table = NULL;
+    dt_entry_t *entries = NULL;
+    dt_range_t *ranges = NULL;
+    uint32_t *firsts = NULL;
+    unsigned char *window = NULL;
+    size_t table_size, window_size = 0;
+    uint64_t win_start, pos;
+    uint32_t entry_size, dt_hdr_size;
+    int qcdt_version;
+    ssize_t ret;
+
+    gz = gzdopen(fd, "rb");
+    if (!gz) {
+        fprintf(stderr, "Can't open stream\n");
+        close(fd);
+        return -ENOMEM;
+    }
+
+    // header
+    table = malloc(DEV_TREE_HEADER_SIZE);
+    if (!table) {
+        rc = -ENOMEM;
+        goto out;
+    }
+    if (gz_read_full(gz, table, DEV_TREE_HEADER_SIZE) != DEV_TREE_HEADER_SIZE ||
+        libboot_qcdt_validate(table, &dt_hdr_size)) {
+        fprintf(stderr, "Cannot validate Device Tree Table \n");
+        goto out;
+    }
+
+    qcdt_version = table->version & 0xff;
+    entry_size = dev_tree_entry_size(table);
+    if (!entry_size) {
+        fprintf(stderr, "ERROR: Unsupported version (%d) in DT table \n", qcdt_version);
+        goto out;
+    }
+    count = table->num_entries;
+    if (count > (STREAM_TABLE_MAX - DEV_TREE_HEADER_SIZE) / entry_size) {
+        fprintf(stderr, "ERROR: DT table with %u entries is too large\n", count);
+        goto out;
+    }
+
+    // entries
+    table_size = DEV_TREE_HEADER_SIZE + (size_t)count * entry_size;
+    table = realloc(table, table_size);
+    entries = malloc((count + 1) * sizeof(*entries));
+    ranges = malloc((count + 1) * sizeof(*ranges));
+    firsts = malloc((count + 1) * sizeof(*firsts));
+    if (!table || !entries || !ranges || !firsts) {
+        fprintf(stderr, "Can't allocate table\n");
+        rc = -ENOMEM;
+        goto out;
+    }
+    if (gz_read_full(gz, (char *)table + DEV_TREE_HEADER_SIZE, table_size - DEV_TREE_HEADER_SIZE) !=
+        (ssize_t)(table_size - DEV_TREE_HEADER_SIZE)) {
+        fprintf(stderr, "ERROR: DT table with %u entries doesn't fit into the file\n", count);
+        goto out;
+    }
+
+    fprintf(stdout, "DTB Total entry: %d, DTB version: %d\n", count, qcdt_version);
+    for (i = 0; i < count; i++) {
+        dev_tree_read_entry(qcdt_version, (unsigned char *)table + DEV_TREE_HEADER_SIZE + i * entry_size, &entries[i]);
+
+        // the table has been consumed already
+        if (entries[i].offset < table_size) {
+            fprintf(stderr, "ERROR: entry %u overlaps the DT table\n", i);
+            goto out;
+        }
+
+        ranges[i].offset = entries[i].offset;
+        ranges[i].size = entries[i].size;
+        ranges[i].first = i;
+    }
+
+    // like the offset set: the first entry of an offset writes its DTB,
+    // which sorts in front of the others sharing it
+    qsort(ranges, count, sizeof(*ranges), compare_ranges);
+    for (i = 0, r = 0; i < count; i++) {
+        if (ranges[i].offset != ranges[r].offset)
+            r = i;
+        firsts[ranges[i].first] = ranges[r].first;
+        if (ranges[i].size > window_size)
+            window_size = ranges[i].size;
+    }
+
+    window = malloc(window_size + 1);
+    if (!window) {
+        fprintf(stderr, "Can't allocate buffer of size %zu\n", window_size);
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    // window holds the stream from win_start to pos
+    win_start = pos = table_size;
+    for (r = 0; r < count; r++) {
+        dt_range_t *range = &ranges[r];
+        uint64_t end = (uint64_t)range->offset + range->size;
+
+        // entries sharing the previous DTB
+        if (firsts[range->first] != range->first) {
+            print_entry("[SKIP] ", &entries[range->first]);
+            if (link_mode != LINK_NONE) {
+                rc = link_entry(directory, firsts[range->first], range->first);
+                if (rc)
+                    goto out;
+            }
+            continue;
+        }
+
+        // drop what's before this DTB
+        if (range->offset > pos) {
+            if (gz_skip(gz, range->offset - pos)) {
+                fprintf(stderr, "ERROR: entry %u is after the end of the file\n", range->first);
+                rc = -1;
+                goto out;
+            }
+            win_start = pos = range->offset;
+        } else if (range->offset > win_start) {
+            memmove(window, window + (range->offset - win_start), pos - range->offset);
+            win_start = range->offset;
+        }
+
+        if (end > pos) {
+            ret = gz_read_full(gz, window + (pos - win_start), end - pos);
+            if (ret < 0 || (uint64_t)ret != end - pos) {
+                fprintf(stderr, "ERROR: entry %u ends after the end of the file\n", range->first);
+                rc = -1;
+                goto out;
+            }
+            pos = end;
+        }
+
+        print_entry("[WRITE]", &entries[range->first]);
+        rc = write_file_entry(directory, window, range->size, range->first);
+        if (rc)
+            goto out;
+    }
+
+    // the manifest is in table order
+    for (i = 0; i < count; i++)
+        manifest_extracted(&entries[i], i, firsts[i]);
+    rc = 0;
+
+out:
+    gzclose(gz);
+    free(window);
+    free(firsts);
+    free(ranges);
+    free(entries);
+    free(table);
+    return rc;
+}
+
+/*
+ * Board selection as done by LK (platform_dt_absolute_match() and
+ * platform_dt_match_best()): an entry is a candidate if msm-id, hardware
+ * platform, subtype and DDR size match the board exactly and none of the
+ * revisions is newer than the board's.  Out of the candidates, the foundry
+ * and then the four pmic models as a whole must match exactly, falling back
+ * to entries which don't specify them (0), then the newest soc, platform and
+ * pmic revisions win.
+ * If that still leaves more than one, the first one in the table is used.
+ */
 typedef struct {
-    list_node_t node;
-    uint32_t offset;
-} dt_offset_t;
+    uint32_t platform_id;       // chipset, with the foundry id in bits 16-23
+    uint32_t variant_id;        // platform, with major/minor in bits 8-23
+    uint32_t hw_subtype;        // subtype, with the DDR size in bits 8-10
+    uint32_t soc_rev;
+    uint32_t pmic_rev[4];
+} board_info_t;
+
+typedef struct {
+    uint32_t index;
+    dt_entry_t entry;
+} dt_match_t;
+
+enum {
+    DTB_FOUNDRY,
+    DTB_PMIC_MODEL,
+    DTB_SOC,
+    DTB_MAJOR_MINOR,
+    DTB_PMIC0,
+    DTB_PMIC1,
+    DTB_PMIC2,
+    DTB_PMIC3,
+    DTB_INFO_MAX,
+};
+
+static int platform_dt_absolute_match(const dt_entry_t *e, const board_info_t *board)
+{
+    int i;
+
+    if ((e->platform_id & 0x0000ffff) != (board->platform_id & 0x0000ffff) ||
+        (e->variant_id & 0x000000ff) != (board->variant_id & 0x000000ff) ||
+        (e->board_hw_subtype & 0xff) != (board->hw_subtype & 0xff) ||
+        (e->board_hw_subtype & 0x700) != (board->hw_subtype & 0x700) ||
+        e->soc_rev > board->soc_rev ||
+        (e->variant_id & 0x00ffff00) > (board->variant_id & 0x00ffff00))
+        return 0;
+
+    for (i = 0; i < 4; i++) {
+        if ((e->pmic_rev[i] & 0x00ffff00) > (board->pmic_rev[i] & 0x00ffff00))
+            return 0;
+    }
 
-static void log_offset(list_node_t *list, uint32_t offset)
+    return 1;
+}
+
+// the 8 bit models of the four pmics packed into one value
+static uint32_t pmic_models(const uint32_t pmic_rev[4])
 {
-    dt_offset_t *dtoff = malloc(sizeof(dt_offset_t));
-    if (!dtoff) return;
+    return (pmic_rev[0] & 0xff) | (pmic_rev[1] & 0xff) << 8 |
+           (pmic_rev[2] & 0xff) << 16 | (pmic_rev[3] & 0xff) << 24;
+}
 
-    dtoff->offset = offset;
-    list_add_tail(list, &dtoff->node);
+// the value of an entry and the board for one step of the selection
+static uint32_t dt_info(int info, const dt_entry_t *e, const board_info_t *board, uint32_t *board_info)
+{
+    switch (info) {
+        case DTB_FOUNDRY:
+            *board_info = board->platform_id & 0x00ff0000;
+            return e->platform_id & 0x00ff0000;
+        case DTB_PMIC_MODEL:
+            // all four models as one tuple, like LK compares them
+            *board_info = pmic_models(board->pmic_rev);
+            return pmic_models(e->pmic_rev);
+        case DTB_SOC:
+            *board_info = board->soc_rev;
+            return e->soc_rev;
+        case DTB_MAJOR_MINOR:
+            *board_info = board->variant_id & 0x00ffff00;
+            return e->variant_id & 0x00ffff00;
+        default:
+            *board_info = board->pmic_rev[info - DTB_PMIC0] & 0x00ffff00;
+            return e->pmic_rev[info - DTB_PMIC0] & 0x00ffff00;
+    }
 }
 
-static int has_offset(list_node_t *list, uint32_t offset)
+// drop all candidates which lose in one step, returns the new count
+static uint32_t platform_dt_match_step(dt_match_t *matches, uint32_t count, int info, const board_info_t *board)
 {
-    dt_offset_t *entry;
+    uint32_t i, n, value, board_info = 0, keep = 0;
+    int exact = info <= DTB_PMIC_MODEL;
+    int found = 0;
 
-    list_for_every_entry(list, entry, dt_offset_t, node) {
-        if (entry->offset==offset) {
-            return 1;
+    for (i = 0; i < count; i++) {
+        value = dt_info(info, &matches[i].entry, board, &board_info);
+        if (exact) {
+            // the board's value, or entries which don't care
+            if (value == board_info) {
+                keep = value;
+                found = 1;
+                break;
+            }
+        } else if (!found || value > keep) {
+            // the newest revision, all are <= the board's already
+            keep = value;
+            found = 1;
         }
     }
+    if (!found)
+        keep = 0;
 
-    return 0;
+    for (i = 0, n = 0; i < count; i++) {
+        if (dt_info(info, &matches[i].entry, board, &board_info) == keep)
+            matches[n++] = matches[i];
+    }
+
+    return n;
 }
 
-off_t fdsize(int fd)
+int dev_tree_match(const char *directory, size_t filesize, dt_table_t *table, const board_info_t *board)
 {
-    off_t off;
+    uint32_t i, count = 0;
+    int rc, info;
+    unsigned char *table_ptr = NULL;
+    dt_match_t *matches;
+    int qcdt_version;
+    uint32_t entry_size;
 
-    off = lseek(fd, 0L, SEEK_END);
-    lseek(fd, 0L, SEEK_SET);
+    table_ptr = (unsigned char *)table + DEV_TREE_HEADER_SIZE;
 
-    return off;
+    qcdt_version = dev_tree_check(filesize, table, &entry_size);
+    if (qcdt_version < 0)
+        return -1;
+
+    matches = malloc((table->num_entries + 1) * sizeof(*matches));
+    if (!matches) {
+        fprintf(stderr, "Can't allocate match table\n");
+        return -ENOMEM;
+    }
+
+    fprintf(stdout, "DTB Total entry: %d, DTB version: %d\n", table->num_entries, qcdt_version);
+    for (i = 0; i < table->num_entries; i++) {
+        dev_tree_read_entry(qcdt_version, table_ptr, &matches[count].entry);
+        table_ptr += entry_size;
+
+        if (platform_dt_absolute_match(&matches[count].entry, board)) {
+            matches[count].index = i;
+            count++;
+        }
+    }
+
+    for (info = 0; info < DTB_INFO_MAX && count > 1; info++)
+        count = platform_dt_match_step(matches, count, info, board);
+
+    if (count == 0) {
+        fprintf(stderr, "No matching DTB\n");
+        rc = -ENOENT;
+        goto free_matches;
+    }
+
+    rc = dev_tree_check_entry(filesize, &matches[0].entry, matches[0].index);
+    if (rc)
+        goto free_matches;
+
+    print_entry("[MATCH]", &matches[0].entry);
+    fprintf(stdout, "entry: %u, offset: 0x%x, size: %u\n",
+            matches[0].index, matches[0].entry.offset, matches[0].entry.size);
+
+    if (directory)
+        rc = write_entry(directory, table, &matches[0].entry, matches[0].index);
+
+free_matches:
+    free(matches);
+    return rc;
 }
 
-int dev_tree_extract(const char *directory, size_t filesize, dt_table_t *table)
+static unsigned char *put_u32(unsigned char *p, uint32_t val)
 {
-    uint32_t i;
+    val = htole32(val);
+    memcpy(p, &val, sizeof(val));
+    return p + sizeof(val);
+}
+
+/*
+ * Print the decoded table to stdout without writing any DTBs.
+ *
+ * The binary form has a header of magic, index version, QCDT version and
+ * entry count, followed by records of entry index, platform_id, variant_id,
+ * board_hw_subtype, soc_rev, pmic_rev[4], offset, size and the SHA-256 of
+ * the DTB.
+ */
+int dev_tree_index(int format, size_t filesize, dt_table_t *table)
+{
+    uint32_t i, j;
     int rc;
     unsigned char *table_ptr = NULL;
     dt_entry_t dt_entry_buf_1;
-    dt_entry_v1_t *dt_entry_v1 = NULL;
-    dt_entry_v2_t *dt_entry_v2 = NULL;
     dt_entry_t *cur_dt_entry = NULL;
-    list_node_t offlist;
-    uint32_t qcdt_version;
-    uint32_t motorola_version;
+    int qcdt_version;
     uint32_t entry_size;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    unsigned char record[INDEX_RECORD_SIZE];
+    unsigned char *p;
+    uint32_t last_offset = 0, last_size = 0;
 
-    list_initialize(&offlist);
     table_ptr = (unsigned char *)table + DEV_TREE_HEADER_SIZE;
     cur_dt_entry = &dt_entry_buf_1;
 
-    qcdt_version = table->version & 0xff;
-    motorola_version = table->version >> 8;
-    switch (qcdt_version) {
-        case DEV_TREE_VERSION_V1:
-            entry_size =  sizeof(dt_entry_v1_t);
-            break;
-        case DEV_TREE_VERSION_V2:
-            entry_size = sizeof(dt_entry_v2_t);
-            break;
-        case DEV_TREE_VERSION_V3:
-            entry_size = sizeof(dt_entry_t);
-            break;
-        default:
-            fprintf(stderr, "ERROR: Unsupported version (%d) in DT table \n", qcdt_version);
-            return -1;
-    }
+    qcdt_version = dev_tree_check(filesize, table, &entry_size);
+    if (qcdt_version < 0)
+        return -1;
 
-    if (motorola_version) {
-        entry_size += 32;
+    if (format == INDEX_BINARY) {
+        memcpy(record, INDEX_MAGIC, 4);
+        p = put_u32(record + 4, INDEX_VERSION);
+        p = put_u32(p, table->version);
+        put_u32(p, table->num_entries);
+        fwrite(record, INDEX_HEADER_SIZE, 1, stdout);
+    } else {
+        fprintf(stdout, "{\n  \"version\": %u,\n  \"entries\": [", qcdt_version);
     }
 
-    fprintf(stdout, "DTB Total entry: %d, DTB version: %d\n", table->num_entries, qcdt_version);
     for (i = 0; i < table->num_entries; i++) {
-        memset(cur_dt_entry, 0, sizeof(*cur_dt_entry));
-        switch (qcdt_version) {
-            case DEV_TREE_VERSION_V1:
-                dt_entry_v1 = (dt_entry_v1_t *)table_ptr;
-                cur_dt_entry->platform_id = dt_entry_v1->platform_id;
-                cur_dt_entry->variant_id = dt_entry_v1->variant_id;
-                cur_dt_entry->soc_rev = dt_entry_v1->soc_rev;
-                cur_dt_entry->board_hw_subtype = (dt_entry_v1->variant_id >> 0x18);
-                /*cur_dt_entry->pmic_rev[0] = board_pmic_target(0);
-                cur_dt_entry->pmic_rev[1] = board_pmic_target(1);
-                cur_dt_entry->pmic_rev[2] = board_pmic_target(2);
-                cur_dt_entry->pmic_rev[3] = board_pmic_target(3);*/
-                cur_dt_entry->offset = dt_entry_v1->offset;
-                cur_dt_entry->size = dt_entry_v1->size;
-                break;
-            case DEV_TREE_VERSION_V2:
-                dt_entry_v2 = (dt_entry_v2_t *)table_ptr;
-                cur_dt_entry->platform_id = dt_entry_v2->platform_id;
-                cur_dt_entry->variant_id = dt_entry_v2->variant_id;
-                cur_dt_entry->soc_rev = dt_entry_v2->soc_rev;
-                /* For V2 version of DTBs we have platform version field as part
-                 * of variant ID, in such case the subtype will be mentioned as 0x0
-                 * As the qcom, board-id = <0xSSPMPmPH, 0x0>
-                 * SS -- Subtype
-                 * PM -- Platform major version
-                 * Pm -- Platform minor version
-                 * PH -- Platform hardware CDP/MTP
-                 * In such case to make it compatible with LK algorithm move the subtype
-                 * from variant_id to subtype field
-                 */
-                if (dt_entry_v2->board_hw_subtype == 0)
-                    cur_dt_entry->board_hw_subtype = (cur_dt_entry->variant_id >> 0x18);
-                else
-                    cur_dt_entry->board_hw_subtype = dt_entry_v2->board_hw_subtype;
-                /*cur_dt_entry->pmic_rev[0] = board_pmic_target(0);
-                cur_dt_entry->pmic_rev[1] = board_pmic_target(1);
-                cur_dt_entry->pmic_rev[2] = board_pmic_target(2);
-                cur_dt_entry->pmic_rev[3] = board_pmic_target(3);*/
-                cur_dt_entry->offset = dt_entry_v2->offset;
-                cur_dt_entry->size = dt_entry_v2->size;
-                break;
-            case DEV_TREE_VERSION_V3:
-                memcpy(cur_dt_entry, (dt_entry_t *)table_ptr,
-                       sizeof(dt_entry_t));
-                /* For V3 version of DTBs we have platform version field as part
-                 * of variant ID, in such case the subtype will be mentioned as 0x0
-                 * As the qcom, board-id = <0xSSPMPmPH, 0x0>
-                 * SS -- Subtype
-                 * PM -- Platform major version
-                 * Pm -- Platform minor version
-                 * PH -- Platform hardware CDP/MTP
-                 * In such case to make it compatible with LK algorithm move the subtype
-                 * from variant_id to subtype field
-                 */
-                if (cur_dt_entry->board_hw_subtype == 0)
-                    cur_dt_entry->board_hw_subtype = (cur_dt_entry->variant_id >> 0x18);
-
-                break;
-            default:
-                fprintf(stderr, "ERROR: Unsupported version (%d) in DT table \n",
-                        qcdt_version);
-                return -1;
-        }
+        dev_tree_read_entry(qcdt_version, table_ptr, cur_dt_entry);
         table_ptr += entry_size;
 
-        if (cur_dt_entry->offset > filesize) {
-            fprintf(stderr, "ERROR: offset %lx of entry %u is greate than the filesize %lx\n", (uint64_t)cur_dt_entry->offset, i, (uint64_t)filesize);
-            return -1;
-        }
+        rc = dev_tree_check_entry(filesize, cur_dt_entry, i);
+        if (rc)
+            return rc;
 
-        int skip = has_offset(&offlist, cur_dt_entry->offset);
-        fprintf(stdout, "%s chipset: %u, rev: %u, platform: %u, subtype: %u, pmic0: %u, pmic1: %u, pmic2: %u, pmic3: %u\n",
-                skip ? "[SKIP] " : "[WRITE]",
-                cur_dt_entry->platform_id, cur_dt_entry->soc_rev, cur_dt_entry->variant_id, cur_dt_entry->board_hw_subtype,
-                cur_dt_entry->pmic_rev[0], cur_dt_entry->pmic_rev[1], cur_dt_entry->pmic_rev[2], cur_dt_entry->pmic_rev[3]);
+        // entries of the same DTB are usually next to each other
+        if (i == 0 || cur_dt_entry->offset != last_offset || cur_dt_entry->size != last_size)
+            sha256(((const char *)table) + cur_dt_entry->offset, cur_dt_entry->size, digest);
+        last_offset = cur_dt_entry->offset;
+        last_size = cur_dt_entry->size;
 
-        if (skip) {
+        if (format == INDEX_BINARY) {
+            p = put_u32(record, i);
+            p = put_u32(p, cur_dt_entry->platform_id);
+            p = put_u32(p, cur_dt_entry->variant_id);
+            p = put_u32(p, cur_dt_entry->board_hw_subtype);
+            p = put_u32(p, cur_dt_entry->soc_rev);
+            for (j = 0; j < 4; j++)
+                p = put_u32(p, cur_dt_entry->pmic_rev[j]);
+            p = put_u32(p, cur_dt_entry->offset);
+            p = put_u32(p, cur_dt_entry->size);
+            memcpy(p, digest, SHA256_DIGEST_SIZE);
+            fwrite(record, INDEX_RECORD_SIZE, 1, stdout);
             continue;
         }
 
-        // build filename
-        char filename[PATH_MAX];
-        rc = snprintf(filename, sizeof(filename), "%s/%u.dtb", directory, i);
-        if (rc<0 || (size_t)rc>=sizeof(filename)) {
-            fprintf(stderr, "Can't build filename\n");
-            return rc;
-        }
+        sha256_to_hex(digest, hex);
+        fprintf(stdout, "%s\n    {\"index\": %u, \"platform_id\": %u, \"variant_id\": %u, "
+                "\"board_hw_subtype\": %u, \"soc_rev\": %u, \"pmic_rev\": [%u, %u, %u, %u], "
+                "\"offset\": %u, \"size\": %u, \"sha256\": \"%s\"}",
+                i ? "," : "", i,
+                cur_dt_entry->platform_id, cur_dt_entry->variant_id,
+                cur_dt_entry->board_hw_subtype, cur_dt_entry->soc_rev,
+                cur_dt_entry->pmic_rev[0], cur_dt_entry->pmic_rev[1],
+                cur_dt_entry->pmic_rev[2], cur_dt_entry->pmic_rev[3],
+                cur_dt_entry->offset, cur_dt_entry->size, hex);
+    }
 
-        // open file
-        FILE *f = fopen(filename, "wb+");
-        if (!f) {
-            fprintf(stderr, "Can't open file %s\n", filename);
-            return -1;
-        }
+    if (format == INDEX_JSON)
+        fprintf(stdout, "\n  ]\n}\n");
 
-        // write dtb
-        fwrite(((char *)table) + cur_dt_entry->offset, cur_dt_entry->size, 1, f);
+    if (fflush(stdout) || ferror(stdout)) {
+        fprintf(stderr, "Can't write index\n");
+        return -EIO;
+    }
 
-        // close file
-        if (fclose(f)) {
-            fprintf(stderr, "Can't close file %s\n", filename);
-            return -1;
+    return 0;
+}
+
+/*
+ * Find the first valid QCDT table at or after start, e.g. inside a boot.img
+ * or a partition dump.  Returns its offset or -1.
+ */
+static ssize_t find_qcdt(unsigned char *img, size_t size, size_t start)
+{
+    unsigned char *p = img + start;
+    const dt_table_t *table;
+    uint32_t dt_hdr_size, entry_size;
+    size_t left;
+
+    while (p + DEV_TREE_HEADER_SIZE <= img + size) {
+        p = memmem(p, img + size - p, "QCDT", 4);
+        if (!p)
+            break;
+
+        left = img + size - p;
+        if (left < DEV_TREE_HEADER_SIZE)
+            break;
+
+        table = (const dt_table_t *)p;
+        entry_size = dev_tree_entry_size(table);
+
+        // the same checks as without scanning, but silent
+        if (!libboot_qcdt_validate(p, &dt_hdr_size) &&
+            dt_hdr_size <= left &&
+            entry_size && table->num_entries &&
+            table->num_entries <= (left - DEV_TREE_HEADER_SIZE) / entry_size)
+            return p - img;
+
+        p++;
+    }
+
+    return -1;
+}
+
+// parse chipset=..,rev=..,platform=..,subtype=..,pmic=a:b:c:d[,foundry=..]
+static int parse_board(const char *str, board_info_t *board)
+{
+    char *spec, *tok, *val, *end, *save = NULL;
+    unsigned long v, foundry = 0;
+    int i, rc = 0;
+
+    memset(board, 0, sizeof(*board));
+
+    spec = strdup(str);
+    if (!spec)
+        return -ENOMEM;
+
+    for (tok = strtok_r(spec, ",", &save); tok && !rc; tok = strtok_r(NULL, ",", &save)) {
+        val = strchr(tok, '=');
+        if (!val) {
+            rc = -EINVAL;
+            break;
         }
+        *val++ = '\0';
 
-        log_offset(&offlist, cur_dt_entry->offset);
+        if (!strcmp(tok, "pmic")) {
+            for (i = 0; i < 4; i++) {
+                board->pmic_rev[i] = strtoul(val, &end, 0);
+                if (end == val || (*end && *end != ':')) {
+                    rc = -EINVAL;
+                    break;
+                }
+                if (!*end)
+                    break;
+                val = end + 1;
+            }
+            if (i == 4)
+                rc = -EINVAL;
+            continue;
+        }
+
+        v = strtoul(val, &end, 0);
+        if (end == val || *end || v > UINT32_MAX) {
+            rc = -EINVAL;
+        } else if (!strcmp(tok, "chipset")) {
+            board->platform_id = v;
+        } else if (!strcmp(tok, "rev")) {
+            board->soc_rev = v;
+        } else if (!strcmp(tok, "platform")) {
+            board->variant_id = v;
+        } else if (!strcmp(tok, "subtype")) {
+            board->hw_subtype = v;
+        } else if (!strcmp(tok, "foundry")) {
+            foundry = v;
+        } else {
+            rc = -EINVAL;
+        }
     }
 
-    while (list_is_empty(&offlist)) {
-        dt_offset_t *entry = list_remove_tail_type(&offlist, dt_offset_t, node);
-        free(entry);
+    board->platform_id |= (foundry & 0xff) << 16;
+
+    free(spec);
+    return rc;
+}
+
+static const char *match;
+static board_info_t board;
+static int index_format = -1;
+static int scan = 0;
+static int jobs = 1;
+static const char *manifest_file;
+static const char *store_dir;
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [--link <type>] [--manifest <file>] [--jobs <count>] [--scan] [--match <board> | --index json|binary] dt.img [outdir]\n", name);
+    fprintf(stderr, "       %s --store <outdir> [--scan] dt.img...\n", name);
+    fprintf(stderr, "  -l, --link <type>    write entries sharing a DTB as hard, symbolic or reflink\n");
+    fprintf(stderr, "                       links to the first one's file instead of skipping them\n");
+    fprintf(stderr, "  -M, --manifest <file> write 'index chipset rev platform subtype pmic0-3\n");
+    fprintf(stderr, "                       offset size file' for every entry to file\n");
+    fprintf(stderr, "  -j, --jobs <count>   write the DTBs with that many threads (0: #cpus)\n");
+    fprintf(stderr, "  -s, --scan           search the input for the table instead of expecting it\n");
+    fprintf(stderr, "                       at the start, e.g. in a boot.img or partition dump\n");
+    fprintf(stderr, "  -m, --match <board>  only extract the DTB the bootloader would pick for\n");
+    fprintf(stderr, "                       chipset=..,rev=..,platform=..,subtype=..,pmic=a:b:c:d[,foundry=..]\n");
+    fprintf(stderr, "                       without outdir, just print its offset and size\n");
+    fprintf(stderr, "  -x, --index <format> print all entries with the SHA-256 of their DTB as\n");
+    fprintf(stderr, "                       json or binary to stdout, without writing any DTBs\n");
+    fprintf(stderr, "  -S, --store <outdir> extract any number of images into the store\n");
+    fprintf(stderr, "                       outdir/objects, DTBs are named by their SHA-256 and\n");
+    fprintf(stderr, "                       outdir/<image>.manifest maps the entries to them\n");
+}
+
+static int open_manifest(const char *path)
+{
+    manifest = fopen(path, "w");
+    if (!manifest) {
+        fprintf(stderr, "Can't open file %s\n", path);
+        return -errno;
     }
 
+    fprintf(manifest, "# index chipset rev platform subtype pmic0 pmic1 pmic2 pmic3 offset size file\n");
     return 0;
 }
 
-int main(int argc, char **argv)
+// open the manifest of an image in the store, named after its path
+static int open_store_manifest(const char *filename)
+{
+    char path[PATH_MAX];
+    char *p;
+    int rc;
+
+    rc = snprintf(path, sizeof(path), "%s/%s.manifest", store_dir, filename);
+    if (rc<0 || (size_t)rc>=sizeof(path)) {
+        fprintf(stderr, "Can't build filename\n");
+        return -ENAMETOOLONG;
+    }
+    for (p = path + strlen(store_dir) + 1; *p; p++) {
+        if (*p == '/')
+            *p = '_';
+    }
+
+    return open_manifest(path);
+}
+
+static int process_image(const char *filename, const char *directory)
 {
     int rc;
     off_t off;
     void *dtimg = NULL;
+    int mapped = 0;
     ssize_t ssize;
+    ssize_t dt_offset = 0;
 
-    // validate arguments
-    if (argc!=3) {
-        fprintf(stderr, "Usage: %s dt.img outdir\n", argv[0]);
-        return -EINVAL;
-    }
-
-    libboot_init();
+    struct stat st;
 
-    // open file
-    const char *filename = argv[1];
-    int fd = open(filename, O_RDONLY);
+    // open file, '-' is stdin
+    int fd = strcmp(filename, "-") ? open(filename, O_RDONLY) : dup(STDIN_FILENO);
     if (fd<0) {
         fprintf(stderr, "Can't open file %s\n", filename);
-        return fd;
+        return -errno;
+    }
+
+    // pipes and sockets can only be read forward
+    if (!fstat(fd, &st) && !S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode)) {
+        if (scan || match || index_format >= 0 || store_dir || jobs > 1) {
+            fprintf(stderr, "%s isn't seekable, only plain extraction is supported\n", filename);
+            close(fd);
+            return -ESPIPE;
+        }
+
+        if (manifest_file) {
+            rc = open_manifest(manifest_file);
+            if (rc) {
+                close(fd);
+                return rc;
+            }
+        }
+
+        // closes fd
+        rc = dev_tree_extract_stream(fd, directory);
+
+        if (manifest && fclose(manifest) && !rc) {
+            fprintf(stderr, "Can't write manifest of %s\n", filename);
+            rc = -EIO;
+        }
+        manifest = NULL;
+        if (rc)
+            fprintf(stderr, "Cannot process table\n");
+        return rc;
     }
 
     // get filesize
@@ -264,40 +1591,118 @@ int main(int argc, char **argv)
         goto close_file;
     }
 
-    // allocate buffer
-    dtimg = malloc(off);
-    if (!dtimg) {
-        fprintf(stderr, "Can't allocate buffer of size %lu\n", off);
-        rc = -ENOMEM;
+    if (off < DEV_TREE_HEADER_SIZE) {
+        fprintf(stderr, "File %s is too small\n", filename);
+        rc = -EINVAL;
         goto close_file;
     }
 
-    // read file into memory
-    ssize = read(fd, dtimg, off);
-    if (ssize!=off) {
-        fprintf(stderr, "Can't read file %s into buffer\n", filename);
-        rc = (int)ssize;
-        goto free_buffer;
+    // map the file, the extracted DTBs are written straight from it
+    dtimg = mmap(NULL, off, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (dtimg != MAP_FAILED) {
+        mapped = 1;
+        ssize = off;
+    } else {
+        // allocate buffer
+        dtimg = malloc(off);
+        if (!dtimg) {
+            fprintf(stderr, "Can't allocate buffer of size %lu\n", off);
+            rc = -ENOMEM;
+            goto close_file;
+        }
+
+        // read file into memory
+        ssize = read_full(fd, dtimg, off);
+        if (ssize!=off) {
+            rc = ssize < 0 ? -errno : -EIO;
+            fprintf(stderr, "Can't read file %s into buffer\n", filename);
+            goto free_buffer;
+        }
+    }
+
+    if (is_gzip(dtimg, ssize)) {
+        void *gzimg;
+        size_t gzsize, gzcap;
+
+        rc = gunzip_image(dtimg, ssize, &gzimg, &gzsize, &gzcap);
+        if (rc) {
+            fprintf(stderr, "Can't decompress file %s\n", filename);
+            goto free_buffer;
+        }
+
+        if (mapped)
+            munmap(dtimg, off);
+        else
+            free(dtimg);
+        dtimg = gzimg;
+        mapped = 1;
+        off = gzcap;
+        ssize = gzsize;
+
+        if (ssize < DEV_TREE_HEADER_SIZE) {
+            fprintf(stderr, "File %s is too small\n", filename);
+            rc = -EINVAL;
+            goto free_buffer;
+        }
+    }
+
+    if (scan) {
+        dt_offset = find_qcdt(dtimg, ssize, 0);
+        if (dt_offset < 0) {
+            fprintf(stderr, "Can't find a Device Tree Table in %s\n", filename);
+            rc = -ENOENT;
+            goto free_buffer;
+        }
+        // stdout may carry the index
+        fprintf(stderr, "Found Device Tree Table at offset 0x%zx\n", (size_t)dt_offset);
     }
 
     // validate devicetree
     uint32_t dt_hdr_size;
-    rc = libboot_qcdt_validate(dtimg, &dt_hdr_size);
+    rc = libboot_qcdt_validate((char *)dtimg + dt_offset, &dt_hdr_size);
     if (rc) {
         fprintf(stderr, "Cannot validate Device Tree Table \n");
         goto free_buffer;
     }
 
-    // generate devtree
-    dt_table_t *table = dtimg;
-    rc = dev_tree_extract(argv[2], (size_t)ssize, table);
+    // generate devtree, the DTB offsets are relative to the table
+    dt_table_t *table = (dt_table_t *)((char *)dtimg + dt_offset);
+    ssize -= dt_offset;
+    if (index_format >= 0)
+        rc = dev_tree_index(index_format, (size_t)ssize, table);
+    else if (match)
+        rc = dev_tree_match(directory, (size_t)ssize, table, &board);
+    else {
+        if (store_dir)
+            rc = open_store_manifest(filename);
+        else if (manifest_file)
+            rc = open_manifest(manifest_file);
+        if (rc)
+            goto free_buffer;
+
+        if (store_dir)
+            rc = dev_tree_store(store_dir, (size_t)ssize, table);
+        else if (jobs > 1)
+            rc = dev_tree_extract_parallel(directory, (size_t)ssize, table, jobs);
+        else
+            rc = dev_tree_extract(directory, (size_t)ssize, table);
+
+        if (manifest && fclose(manifest) && !rc) {
+            fprintf(stderr, "Can't write manifest of %s\n", filename);
+            rc = -EIO;
+        }
+        manifest = NULL;
+    }
     if (rc) {
         fprintf(stderr, "Cannot process table\n");
         goto free_buffer;
     }
 
 free_buffer:
-    free(dtimg);
+    if (mapped)
+        munmap(dtimg, off);
+    else
+        free(dtimg);
 
 close_file:
     // close file
@@ -306,10 +1711,140 @@ close_file:
         return rc;
     }
 
-    if (rc) {
-        fprintf(stderr, "ERROR: %s\n", strerror(-rc));
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    int rc = 0;
+    const char *directory = NULL;
+    char path[PATH_MAX];
+    int i, failed = 0;
+    int c;
+
+    static const struct option long_options[] = {
+        {"match", required_argument, 0, 'm'},
+        {"index", required_argument, 0, 'x'},
+        {"scan",  no_argument,       0, 's'},
+        {"jobs",  required_argument, 0, 'j'},
+        {"link",  required_argument, 0, 'l'},
+        {"manifest", required_argument, 0, 'M'},
+        {"store", required_argument, 0, 'S'},
+        {"help",  no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while ((c = getopt_long(argc, argv, "m:x:sj:l:M:S:h", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'm':
+                match = optarg;
+                break;
+            case 's':
+                scan = 1;
+                break;
+            case 'l':
+                if (!strcmp(optarg, "hard")) {
+                    link_mode = LINK_HARD;
+                } else if (!strcmp(optarg, "symbolic")) {
+                    link_mode = LINK_SYMBOLIC;
+                } else if (!strcmp(optarg, "reflink")) {
+                    link_mode = LINK_REFLINK;
+                } else {
+                    fprintf(stderr, "Unknown link type '%s'\n", optarg);
+                    return -EINVAL;
+                }
+                break;
+            case 'M':
+                manifest_file = optarg;
+                break;
+            case 'S':
+                store_dir = optarg;
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs == 0)
+                    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+                if (jobs <= 0) {
+                    fprintf(stderr, "Invalid number of jobs\n");
+                    return -EINVAL;
+                }
+                break;
+            case 'x':
+                if (!strcmp(optarg, "json")) {
+                    index_format = INDEX_JSON;
+                } else if (!strcmp(optarg, "binary")) {
+                    index_format = INDEX_BINARY;
+                } else {
+                    fprintf(stderr, "Unknown index format '%s'\n", optarg);
+                    return -EINVAL;
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                return -EINVAL;
+        }
+    }
+
+    // validate arguments
+    if (store_dir) {
+        if (argc - optind < 1 || match || index_format >= 0 || link_mode != LINK_NONE ||
+            manifest_file || jobs > 1) {
+            print_usage(argv[0]);
+            return -EINVAL;
+        }
+    } else if (argc - optind == 2 && index_format < 0) {
+        directory = argv[optind + 1];
+    } else if ((!match && index_format < 0) || (match && index_format >= 0) || argc - optind != 1) {
+        print_usage(argv[0]);
+        return -EINVAL;
+    }
+
+    if ((link_mode != LINK_NONE || manifest_file) && (match || index_format >= 0)) {
+        print_usage(argv[0]);
+        return -EINVAL;
+    }
+
+    if (match && parse_board(match, &board)) {
+        fprintf(stderr, "Invalid board description '%s'\n", match);
+        return -EINVAL;
+    }
+
+    libboot_init();
+
+    if (!store_dir) {
+        rc = process_image(argv[optind], directory);
+        if (rc) {
+            fprintf(stderr, "ERROR: %s\n", strerror(-rc));
+            return rc;
+        }
         return rc;
     }
 
-    return rc;
+    rc = snprintf(path, sizeof(path), "%s/objects", store_dir);
+    if (rc<0 || (size_t)rc>=sizeof(path)) {
+        fprintf(stderr, "Can't build filename\n");
+        return -ENAMETOOLONG;
+    }
+    if ((mkdir(store_dir, 0777) && errno != EEXIST) ||
+        (mkdir(path, 0777) && errno != EEXIST)) {
+        fprintf(stderr, "Can't create directory %s\n", path);
+        return -errno;
+    }
+
+    // keep going, one broken image shouldn't stop a batch
+    for (i = optind; i < argc; i++) {
+        fprintf(stdout, "Image: %s\n", argv[i]);
+        rc = process_image(argv[i], NULL);
+        if (rc) {
+            fprintf(stderr, "ERROR: %s: %s\n", argv[i], strerror(-rc));
+            failed++;
+        }
+    }
+
+    if (failed) {
+        fprintf(stderr, "%d of %d images failed\n", failed, argc - optind);
+        return -EIO;
+    }
+
+    return 0;
 }